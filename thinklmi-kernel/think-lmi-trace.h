@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for the WMI calls made by the think-lmi driver. Method
+ * calls carry a label naming the item or opcode only, never the value or
+ * any password.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM think_lmi
+
+#if !defined(_THINK_LMI_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _THINK_LMI_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* __assign_str() takes its source from __string() since 6.10 */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0))
+#define think_lmi_assign_str(dst, src) __assign_str(dst)
+#else
+#define think_lmi_assign_str(dst, src) __assign_str(dst, src)
+#endif
+
+TRACE_EVENT(think_lmi_query,
+	TP_PROTO(const char *guid, int item),
+	TP_ARGS(guid, item),
+	TP_STRUCT__entry(
+		__string(guid, guid)
+		__field(int, item)
+	),
+	TP_fast_assign(
+		think_lmi_assign_str(guid, guid);
+		__entry->item = item;
+	),
+	TP_printk("guid=%s item=%d", __get_str(guid), __entry->item)
+);
+
+TRACE_EVENT(think_lmi_query_done,
+	TP_PROTO(const char *guid, int item, u32 status, int err, u64 us),
+	TP_ARGS(guid, item, status, err, us),
+	TP_STRUCT__entry(
+		__string(guid, guid)
+		__field(int, item)
+		__field(u32, status)
+		__field(int, err)
+		__field(u64, us)
+	),
+	TP_fast_assign(
+		think_lmi_assign_str(guid, guid);
+		__entry->item = item;
+		__entry->status = status;
+		__entry->err = err;
+		__entry->us = us;
+	),
+	TP_printk("guid=%s item=%d status=0x%x err=%d us=%llu",
+		  __get_str(guid), __entry->item, __entry->status,
+		  __entry->err, __entry->us)
+);
+
+TRACE_EVENT(think_lmi_method,
+	TP_PROTO(const char *guid, const char *label),
+	TP_ARGS(guid, label),
+	TP_STRUCT__entry(
+		__string(guid, guid)
+		__string(label, label)
+	),
+	TP_fast_assign(
+		think_lmi_assign_str(guid, guid);
+		think_lmi_assign_str(label, label);
+	),
+	TP_printk("guid=%s label=%s", __get_str(guid), __get_str(label))
+);
+
+TRACE_EVENT(think_lmi_method_done,
+	TP_PROTO(const char *guid, const char *label, u32 status, int err,
+		 u64 us),
+	TP_ARGS(guid, label, status, err, us),
+	TP_STRUCT__entry(
+		__string(guid, guid)
+		__string(label, label)
+		__field(u32, status)
+		__field(int, err)
+		__field(u64, us)
+	),
+	TP_fast_assign(
+		think_lmi_assign_str(guid, guid);
+		think_lmi_assign_str(label, label);
+		__entry->status = status;
+		__entry->err = err;
+		__entry->us = us;
+	),
+	TP_printk("guid=%s label=%s status=0x%x err=%d us=%llu",
+		  __get_str(guid), __get_str(label), __entry->status,
+		  __entry->err, __entry->us)
+);
+
+#endif /* _THINK_LMI_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE think-lmi-trace
+#include <trace/define_trace.h>
@@ -27,23 +27,43 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/crc32.h>
+#include <linux/ctype.h>
 #include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/dmi.h>
+#include <linux/eventfd.h>
+#include <linux/firmware.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/pm.h>
+#include <linux/poll.h>
+#include <linux/rwsem.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/wmi.h>
+#include <linux/workqueue.h>
 #include <linux/acpi.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
 #include <linux/version.h>
 #include "think-lmi.h"
 
+#define CREATE_TRACE_POINTS
+#include "think-lmi-trace.h"
+
 #define	THINK_LMI_FILE	"think-lmi"
 
 MODULE_AUTHOR("Sugumaran L <slacshiminar@lenovo.com>");
@@ -52,6 +72,21 @@ MODULE_AUTHOR("Corentin Chary <corentin.chary@gmail.com>");
 MODULE_DESCRIPTION("Think LMI Driver");
 MODULE_LICENSE("GPL");
 
+static int duplicate_call = -1;
+module_param(duplicate_call, int, 0444);
+MODULE_PARM_DESC(duplicate_call,
+		 "Evaluate WMI methods twice as a BIOS workaround (-1 = auto from DMI, 0 = off, 1 = on)");
+
+static bool use_snapshot = true;
+module_param(use_snapshot, bool, 0444);
+MODULE_PARM_DESC(use_snapshot,
+		 "Load the settings list from think-lmi-settings.bin when it matches the BIOS version");
+
+static unsigned int capture;
+module_param(capture, uint, 0444);
+MODULE_PARM_DESC(capture,
+		 "Record the last N WMI calls from load on, see capture in debugfs");
+
 /* LMI interface */
 
 /**
@@ -258,6 +293,46 @@ enum {
 
 #define TLMI_NUM_DEVICES 1
 
+/* WMI instances are addressed with a u8 index */
+#define TLMI_MAX_INSTANCES (U8_MAX + 1)
+/* Growth step for the settings table when the instance count is unknown */
+#define TLMI_SETTINGS_CHUNK 64
+#define TLMI_NAMES_CHUNK 4096 /* Initial size of the setting names arena */
+
+/*
+ * A saved copy of the enumerated settings, loaded as firmware to skip the
+ * scan at probe. It is made by reading the snapshot file in debugfs.
+ */
+#define TLMI_SNAPSHOT_FW	"think-lmi-settings.bin"
+#define TLMI_SNAPSHOT_MAGIC	0x534d4c54 /* "TLMS" */
+#define TLMI_SNAPSHOT_VERSION	1
+
+/* Followed by one struct think_lmi_snapshot_slot per slot, then names */
+struct think_lmi_snapshot {
+	__le32 magic;
+	__le32 version;
+	char bios_version[64];	/* DMI BIOS version the list was read from */
+	__le32 slots;
+	__le32 names_len;
+	__le32 checksum;	/* crc32 of everything after this header */
+	__le32 reserved;
+};
+
+struct think_lmi_snapshot_slot {
+	__le32 name_off;
+	__le32 wmi_name_off;	/* 0 for an empty slot */
+};
+#define TLMI_SETTINGS_HASH_BITS 8
+
+/* Platform quirks */
+#define TLMI_QUIRK_DUPLICATE_CALL BIT(0)
+#define TLMI_CHANGE_RING 64 /* Change events kept for slow readers */
+/* "Item,Value,Password,Encoding,KbdLang;" */
+#define TLMI_SET_CMD_MAXLEN (TLMI_SETTINGS_MAXLEN + TLMI_GETSET_MAXLEN + \
+			     TLMI_PWD_MAXLEN + TLMI_ENC_MAXLEN + \
+			     TLMI_LANG_MAXLEN + 4)
+#define TLMI_CHOICES_HASH_BITS  5
+
 MODULE_ALIAS("tlmi:"LENOVO_BIOS_SETTING_GUID);
 
 struct think_lmi_pcfg {
@@ -269,10 +344,56 @@ struct think_lmi_pcfg {
 	uint32_t supported_keyboard;
 };
 
-struct think_lmi {
-	struct wmi_device *wmi_device;
+/*
+ * A list of valid values from Lenovo_GetBiosSelections. Many settings
+ * share the same list, so each distinct list is stored once.
+ */
+struct think_lmi_choices {
+	struct hlist_node hnode;
+	struct kref ref;
+	u32 hash;
+	char str[];
+};
 
-	int settings_count;
+/* One enumerated Lenovo_BiosSetting instance */
+struct think_lmi_setting {
+	struct hlist_node hnode;
+	u32 hash;
+	int index;
+	/*
+	 * Offsets into the names arena, set while enumerating, and the
+	 * strings they point to once it is complete.
+	 */
+	unsigned int name_off;
+	unsigned int wmi_name_off;
+	char *name;	/* Name shown to userspace, with '/' as '\' */
+	char *wmi_name;	/* Name as the BIOS expects it */
+	char *value;	/* Cached "Item,Value" string, NULL if not read */
+	struct think_lmi_choices *choices; /* NULL if not read yet */
+	bool rewarm;	/* Cached before a resume, read again after it */
+};
+
+/*
+ * State of one open of the character device: its authentication session
+ * and its asynchronous requests. Each queued request holds a reference,
+ * and so does work while it is queued.
+ */
+struct think_lmi_file {
+	struct think_lmi *think;
+	struct kref ref;
+	struct work_struct work; /* Runs pending requests in order */
+
+	spinlock_t lock;	/* Protects the fields below */
+	struct list_head pending; /* Submitted requests not run yet */
+	struct list_head done;	/* Completed requests not read yet */
+	unsigned int async_count; /* Pending or unread requests */
+	u64 next_ticket;
+	struct eventfd_ctx *eventfd;
+
+	bool watching;		/* Wants change events */
+	struct list_head watch_node; /* On watchers, under change_lock */
+	struct fasync_struct *fasync;
+	u64 seen_gen;		/* Last change event read, under change_lock */
 
 	char password[TLMI_PWD_MAXLEN];
 	char password_encoding[TLMI_ENC_MAXLEN];
@@ -280,9 +401,32 @@ struct think_lmi {
 	char auth_string[TLMI_PWD_MAXLEN + TLMI_ENC_MAXLEN
 		                      + TLMI_LANG_MAXLEN + 2];
 	char password_type[TLMI_PWDTYPE_MAXLEN];
-	char tpm_type[TLMI_TPMTYPE_MAXLEN];
 	char passcurr[TLMI_PWD_MAXLEN];
 	char passnew[TLMI_PWD_MAXLEN];
+};
+
+/* One successful change to the BIOS configuration */
+struct think_lmi_change {
+	u64 gen;
+	u32 reason;
+	u32 count;	/* 0 if any setting may have changed */
+	s32 index[TLMI_BATCH_MAX];
+};
+
+struct think_lmi {
+	struct wmi_device *wmi_device;
+
+	int settings_count;
+	int settings_size; /* Number of slots in settings, one per instance */
+	/*
+	 * All setting names, NUL separated. Offset 0 holds an empty string,
+	 * as in ELF string tables, so a zero offset marks an empty slot.
+	 */
+	char *names;
+	size_t names_len;
+	size_t names_size;
+
+	char tpm_type[TLMI_TPMTYPE_MAXLEN];
 
 	bool can_set_bios_settings;
 	bool can_discard_bios_settings;
@@ -291,14 +435,313 @@ struct think_lmi {
 	bool can_set_bios_password;
 	bool can_get_password_settings;
 
-	unsigned char *settings[TLMI_MAX_SETTINGS];
+	struct think_lmi_setting *settings;
+	struct workqueue_struct *async_wq;
+	DECLARE_HASHTABLE(setting_hash, TLMI_SETTINGS_HASH_BITS);
+	DECLARE_HASHTABLE(choices_hash, TLMI_CHOICES_HASH_BITS);
+	/*
+	 * Cached values and choices are read under cache_sem, so readers
+	 * run in parallel. The BIOS is never called with it held. Sequences
+	 * of WMI calls that change state are serialised by wmi_lock, which
+	 * also protects the authentication state of every open file.
+	 */
+	struct rw_semaphore cache_sem;
+	unsigned long cache_gen; /* Bumped whenever values are invalidated */
+	struct mutex wmi_lock;
+	char set_cmd[TLMI_SET_CMD_MAXLEN]; /* Scratch, under wmi_lock */
 	struct dev_ext_attribute *devattrs;
 	struct cdev c_dev;
+
+	struct dentry *debugfs_dir;
+
+	/* Readers of the character device wait here for events */
+	wait_queue_head_t event_wait;
+	struct mutex change_lock; /* Protects the fields below */
+	struct list_head watchers; /* Files that enabled change events */
+	u64 change_gen;
+	struct think_lmi_change *changes; /* Ring of TLMI_CHANGE_RING */
+
+	/* Settings enumeration runs in the background after probe */
+	struct work_struct analyze_work;
+	struct completion analyze_done;
+	u64 analyze_us;
+	bool from_snapshot;	/* Settings list loaded, not scanned */
+	bool unloading;		/* Stops the resume work */
+
+	/*
+	 * The BIOS setup may change settings while the system is suspended
+	 * or hibernated. Resume only bumps resume_epoch; cached values of an
+	 * older epoch are dropped before anything is served from the cache.
+	 */
+	atomic_t resume_epoch;
+	int values_epoch;	/* resume_epoch of the cached values */
+	struct work_struct resume_work;
 };
 
 static dev_t tlmi_dev;
 static struct class *tlmi_class;
 
+static unsigned long think_lmi_quirks;
+static atomic_t think_lmi_skipped_calls = ATOMIC_INIT(0);
+/*
+ * Allocations made with think_lmi_alloc(). Every path an ioctl can reach
+ * allocates through it, both its own buffers and the strings read from
+ * the BIOS, so cached shows, sets and vectored gets leave it unchanged.
+ * Reads done in the background count too.
+ */
+static atomic_t think_lmi_allocs = ATOMIC_INIT(0);
+
+/* Count an allocation in think_lmi_allocs. Free it with kvfree(). */
+static void *think_lmi_alloc(size_t n, size_t size, gfp_t flags)
+{
+	atomic_inc(&think_lmi_allocs);
+	return kvmalloc_array(n, size, flags);
+}
+
+static char *think_lmi_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p = think_lmi_alloc(1, len, GFP_KERNEL);
+
+	if (p)
+		memcpy(p, str, len);
+	return p;
+}
+
+/*
+ * Method calls used to be evaluated twice for a BIOS behaviour seen when
+ * WMI is accessed via scripting on other OS. Platforms confirmed not to
+ * need this can be listed ahead of the catch-all entry with no quirks.
+ */
+static const struct dmi_system_id think_lmi_quirk_table[] = {
+	{
+		.ident = "Lenovo",
+		.matches = {
+			DMI_MATCH(DMI_SYS_VENDOR, "LENOVO"),
+		},
+		.driver_data = (void *)TLMI_QUIRK_DUPLICATE_CALL,
+	},
+	{ }
+};
+
+/* Outcomes counted for every WMI call */
+enum think_lmi_result {
+	TLMI_RESULT_SUCCESS,
+	TLMI_RESULT_NOT_SUPPORTED,
+	TLMI_RESULT_INVALID,
+	TLMI_RESULT_ACCESS_DENIED,
+	TLMI_RESULT_SYSTEM_BUSY,
+	TLMI_RESULT_IO_ERROR,	/* ACPI failure or malformed output */
+	TLMI_RESULT_OTHER,
+	TLMI_RESULT_COUNT
+};
+
+static const char * const think_lmi_result_names[TLMI_RESULT_COUNT] = {
+	[TLMI_RESULT_SUCCESS]       = "success",
+	[TLMI_RESULT_NOT_SUPPORTED] = "not_supported",
+	[TLMI_RESULT_INVALID]       = "invalid",
+	[TLMI_RESULT_ACCESS_DENIED] = "access_denied",
+	[TLMI_RESULT_SYSTEM_BUSY]   = "system_busy",
+	[TLMI_RESULT_IO_ERROR]      = "io_error",
+	[TLMI_RESULT_OTHER]         = "other",
+};
+
+/* Bucket n counts calls taking [2^(n-1), 2^n) us, the last one the rest */
+#define TLMI_LATENCY_BUCKETS 24
+
+/* Calls to one WMI GUID, shown in debugfs under stats/ */
+struct think_lmi_wmi_stats {
+	const char *name;
+	const char *guid;
+	atomic_long_t calls;
+	atomic64_t total_us;
+	atomic_long_t results[TLMI_RESULT_COUNT];
+	atomic_long_t latency[TLMI_LATENCY_BUCKETS];
+};
+
+static struct think_lmi_wmi_stats think_lmi_stats[] = {
+	{ .name = "bios_setting",       .guid = LENOVO_BIOS_SETTING_GUID },
+	{ .name = "set_bios_settings",  .guid = LENOVO_SET_BIOS_SETTINGS_GUID },
+	{ .name = "save_bios_settings", .guid = LENOVO_SAVE_BIOS_SETTINGS_GUID },
+	{ .name = "discard_bios_settings",
+	  .guid = LENOVO_DISCARD_BIOS_SETTINGS_GUID },
+	{ .name = "load_default_settings",
+	  .guid = LENOVO_LOAD_DEFAULT_SETTINGS_GUID },
+	{ .name = "set_bios_password",  .guid = LENOVO_SET_BIOS_PASSWORD_GUID },
+	{ .name = "get_bios_selections",
+	  .guid = LENOVO_GET_BIOS_SELECTIONS_GUID },
+	{ .name = "set_platform_settings",
+	  .guid = LENOVO_SET_PLATFORM_SETTINGS_GUID },
+	{ .name = "lmiopcode",          .guid = LENOVO_LMIOPCODE_SETTING_GUID },
+};
+
+static enum think_lmi_result think_lmi_result_of(int err)
+{
+	switch (err) {
+	case THINK_LMI_SUCCESS:
+		return TLMI_RESULT_SUCCESS;
+	case THINK_LMI_NOT_SUPPORTED:
+		return TLMI_RESULT_NOT_SUPPORTED;
+	case THINK_LMI_INVALID:
+		return TLMI_RESULT_INVALID;
+	case THINK_LMI_ACCESS_DENIED:
+		return TLMI_RESULT_ACCESS_DENIED;
+	case THINK_LMI_SYSTEM_BUSY:
+		return TLMI_RESULT_SYSTEM_BUSY;
+	case -EIO:
+		return TLMI_RESULT_IO_ERROR;
+	}
+	return TLMI_RESULT_OTHER;
+}
+
+/* Count a WMI call that took us microseconds and returned err */
+static void think_lmi_account(const char *guid, u64 us, int err)
+{
+	struct think_lmi_wmi_stats *stats;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(think_lmi_stats); i++) {
+		stats = &think_lmi_stats[i];
+		if (strcmp(stats->guid, guid))
+			continue;
+		atomic_long_inc(&stats->calls);
+		atomic64_add(us, &stats->total_us);
+		atomic_long_inc(&stats->results[think_lmi_result_of(err)]);
+		atomic_long_inc(&stats->latency[min_t(int, fls64(us),
+					TLMI_LATENCY_BUCKETS - 1)]);
+		return;
+	}
+}
+
+/* Name a WMI GUID as in stats/, or by the GUID if it has no stats */
+static const char *think_lmi_guid_name(const char *guid)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(think_lmi_stats); i++) {
+		if (!strcmp(think_lmi_stats[i].guid, guid))
+			return think_lmi_stats[i].name;
+	}
+	return guid;
+}
+
+/*
+ * Capture mode keeps the last WMI calls with their replies and latency in
+ * a ring, exported by the capture file in debugfs. thinklmi-mock can
+ * replay such a trace. Method inputs are cut down to their trace label,
+ * so no password is ever recorded.
+ */
+#define TLMI_CAPTURE_MAX 65536
+
+struct think_lmi_capture_entry {
+	const char *guid;
+	u64 start_us;		/* Since the capture was started */
+	u64 us;
+	int instance;		/* Instance queried, -1 for a method */
+	int calls;		/* 2 for a method evaluated twice */
+	acpi_status status;
+	char *input;
+	char *output;		/* NULL if no string was returned */
+};
+
+static DEFINE_MUTEX(think_lmi_capture_lock);
+static bool think_lmi_capturing;
+static struct think_lmi_capture_entry *think_lmi_capture_ring;
+static unsigned int think_lmi_capture_size;
+static unsigned long think_lmi_capture_count;	/* Calls recorded */
+static ktime_t think_lmi_capture_start;
+
+static void think_lmi_capture_free(void)
+{
+	int i;
+
+	for (i = 0; i < think_lmi_capture_size; i++) {
+		kvfree(think_lmi_capture_ring[i].input);
+		kvfree(think_lmi_capture_ring[i].output);
+	}
+	kvfree(think_lmi_capture_ring);
+	WRITE_ONCE(think_lmi_capturing, false);
+	think_lmi_capture_ring = NULL;
+	think_lmi_capture_size = 0;
+	think_lmi_capture_count = 0;
+}
+
+/*
+ * Start a new capture of the last size calls, dropping the previous one,
+ * or stop capturing with size 0. What was captured can still be read
+ * after stopping.
+ */
+static int think_lmi_capture_set(unsigned int size)
+{
+	struct think_lmi_capture_entry *ring = NULL;
+
+	if (size > TLMI_CAPTURE_MAX)
+		return -EINVAL;
+	if (size) {
+		ring = kvmalloc_array(size, sizeof(*ring),
+				      GFP_KERNEL | __GFP_ZERO);
+		if (!ring)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&think_lmi_capture_lock);
+	if (ring) {
+		think_lmi_capture_free();
+		think_lmi_capture_ring = ring;
+		think_lmi_capture_size = size;
+		think_lmi_capture_start = ktime_get();
+	}
+	WRITE_ONCE(think_lmi_capturing, !!size);
+	mutex_unlock(&think_lmi_capture_lock);
+	return 0;
+}
+
+/* Record a WMI call whose output has not been freed yet */
+static void think_lmi_capture(const char *guid, int instance,
+			      const char *input, acpi_status status,
+			      const struct acpi_buffer *output, ktime_t start,
+			      u64 us, int calls)
+{
+	const union acpi_object *obj = output->pointer;
+	struct think_lmi_capture_entry *entry;
+	char *in, *out = NULL, *old_in, *old_out;
+
+	if (!READ_ONCE(think_lmi_capturing))
+		return;
+
+	in = think_lmi_strdup(input);
+	if (ACPI_SUCCESS(status) && obj && obj->type == ACPI_TYPE_STRING &&
+	    obj->string.pointer)
+		out = think_lmi_strdup(obj->string.pointer);
+
+	mutex_lock(&think_lmi_capture_lock);
+	if (!think_lmi_capturing) {
+		mutex_unlock(&think_lmi_capture_lock);
+		kvfree(in);
+		kvfree(out);
+		return;
+	}
+	entry = &think_lmi_capture_ring[think_lmi_capture_count++ %
+					think_lmi_capture_size];
+	old_in = entry->input;
+	old_out = entry->output;
+	*entry = (struct think_lmi_capture_entry) {
+		.guid = guid,
+		/* A call may have started just before the capture */
+		.start_us = max_t(s64, ktime_us_delta(start,
+					think_lmi_capture_start), 0),
+		.us = us,
+		.instance = instance,
+		.calls = calls,
+		.status = status,
+		.input = in,
+		.output = out,
+	};
+	mutex_unlock(&think_lmi_capture_lock);
+	kvfree(old_in);
+	kvfree(old_out);
+}
+
 static int think_lmi_errstr_to_err(const char *errstr)
 {
 	if (!strcmp(errstr, "Success"))
@@ -331,23 +774,72 @@ static int think_lmi_extract_error(const struct acpi_buffer *output)
 	return ret;
 }
 
+/*
+ * Label a method call for tracing with the item being set or the opcode.
+ * Other calls only pass credentials and get an empty label.
+ */
+static void think_lmi_trace_label(const char *guid, const char *arg,
+				  char *buf, size_t size)
+{
+	const char *end = NULL;
+
+	if (!strcmp(guid, LENOVO_SET_BIOS_SETTINGS_GUID) ||
+	    !strcmp(guid, LENOVO_SET_PLATFORM_SETTINGS_GUID))
+		end = strchr(arg, ',');
+	else if (!strcmp(guid, LENOVO_LMIOPCODE_SETTING_GUID))
+		end = strpbrk(arg, ":;");
+
+	if (end)
+		strscpy(buf, arg, min_t(size_t, end - arg + 1, size));
+	else
+		buf[0] = '\0';
+}
+
 static int think_lmi_simple_call(const char *guid,
 				    const char *arg)
 {
 	const struct acpi_buffer input = { strlen(arg), (char *)arg };
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	char label[128] = "";	/* Long names are cut short in traces */
+	ktime_t start;
 	acpi_status status;
+	int calls = 1;
+	u64 us;
+	int ret;
+
+	if (trace_think_lmi_method_enabled() ||
+	    trace_think_lmi_method_done_enabled() ||
+	    READ_ONCE(think_lmi_capturing))
+		think_lmi_trace_label(guid, arg, label, sizeof(label));
+	trace_think_lmi_method(guid, label);
+
+	start = ktime_get();
+	status = wmi_evaluate_method(guid, 0, 0, &input, &output);
 	/*
 	 * duplicated call required to match bios workaround for behavior
 	 * seen when WMI accessed via scripting on other OS
 	 */
-	status = wmi_evaluate_method(guid, 0, 0, &input, &output);
-	status = wmi_evaluate_method(guid, 0, 0, &input, &output);
+	if (think_lmi_quirks & TLMI_QUIRK_DUPLICATE_CALL) {
+		kfree(output.pointer);
+		output.length = ACPI_ALLOCATE_BUFFER;
+		output.pointer = NULL;
+		status = wmi_evaluate_method(guid, 0, 0, &input, &output);
+		calls = 2;
+	} else {
+		atomic_inc(&think_lmi_skipped_calls);
+	}
+
+	us = ktime_us_delta(ktime_get(), start);
+	think_lmi_capture(guid, -1, label, status, &output, start, us, calls);
 
 	if (ACPI_FAILURE(status))
-		return -EIO;
+		ret = -EIO;
+	else
+		ret = think_lmi_extract_error(&output);
 
-	return think_lmi_extract_error(&output);
+	think_lmi_account(guid, us, ret);
+	trace_think_lmi_method_done(guid, label, status, ret, us);
+	return ret;
 }
 
 static int think_lmi_extract_output_string(const struct acpi_buffer
@@ -359,7 +851,7 @@ static int think_lmi_extract_output_string(const struct acpi_buffer
 	if (!obj || obj->type != ACPI_TYPE_STRING || !obj->string.pointer)
 		return -EIO;
 
-	*string = kstrdup(obj->string.pointer, GFP_KERNEL);
+	*string = think_lmi_strdup(obj->string.pointer);
 	kfree(obj);
 	return *string ? 0 : -ENOMEM;
 }
@@ -368,33 +860,58 @@ static int think_lmi_setting(int item, char **value,
 		                  const char *guid_string)
 {
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	ktime_t start;
 	acpi_status status;
+	u64 us;
+	int ret;
 
+	trace_think_lmi_query(guid_string, item);
+	start = ktime_get();
 	status = wmi_query_block(guid_string, item, &output);
+	us = ktime_us_delta(ktime_get(), start);
+	think_lmi_capture(guid_string, item, "", status, &output, start, us, 1);
+
 	if (ACPI_FAILURE(status))
-		return -EIO;
+		ret = -EIO;
+	else
+		ret = think_lmi_extract_output_string(&output, value);
 
-	return think_lmi_extract_output_string(&output, value);
+	think_lmi_account(guid_string, us, ret);
+	trace_think_lmi_query_done(guid_string, item, status, ret, us);
+	return ret;
 }
 
 static int think_lmi_get_bios_selections(const char *item, char **value)
 {
 	const struct acpi_buffer input = { strlen(item), (char *)item };
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	ktime_t start;
 	acpi_status status;
+	u64 us;
+	int ret;
 
+	/* The argument is just the setting name */
+	trace_think_lmi_method(LENOVO_GET_BIOS_SELECTIONS_GUID, item);
+	start = ktime_get();
 	status = wmi_evaluate_method(LENOVO_GET_BIOS_SELECTIONS_GUID,
 				     0, 0, &input, &output);
+	us = ktime_us_delta(ktime_get(), start);
+	think_lmi_capture(LENOVO_GET_BIOS_SELECTIONS_GUID, -1, item, status,
+			  &output, start, us, 1);
 
 	if (ACPI_FAILURE(status))
-		return -EIO;
+		ret = -EIO;
+	else
+		ret = think_lmi_extract_output_string(&output, value);
 
-	return think_lmi_extract_output_string(&output, value);
+	think_lmi_account(LENOVO_GET_BIOS_SELECTIONS_GUID, us, ret);
+	trace_think_lmi_method_done(LENOVO_GET_BIOS_SELECTIONS_GUID, item,
+				    status, ret, us);
+	return ret;
 }
 
 static int think_lmi_set_bios_settings(const char *settings)
 {
-	strreplace(settings,'\\','/');
 	return think_lmi_simple_call(LENOVO_SET_BIOS_SETTINGS_GUID, settings);
 }
 
@@ -428,215 +945,1647 @@ static int think_lmi_load_default(const char *password)
 }
 
 /* Create the auth string from password chunks */
-static void update_auth_string(struct think_lmi *think)
+static void update_auth_string(struct think_lmi_file *ctx)
 {
-	if (!*think->password) {
+	if (!*ctx->password) {
 		/* No password at all */
-		think->auth_string[0] = '\0';
+		ctx->auth_string[0] = '\0';
 		return;
 	}
-	strcpy(think->auth_string, think->password);
+	strcpy(ctx->auth_string, ctx->password);
+
+	if (*ctx->password_encoding) {
+		strcat(ctx->auth_string, ",");
+		strcat(ctx->auth_string, ctx->password_encoding);
+	}
 
-	if (*think->password_encoding) {
-		strcat(think->auth_string, ",");
-		strcat(think->auth_string, think->password_encoding);
+	if (*ctx->password_kbdlang) {
+		strcat(ctx->auth_string, ",");
+		strcat(ctx->auth_string, ctx->password_kbdlang);
 	}
+}
+
+/*
+ * Send a new value for a setting to the BIOS without saving it. The name
+ * is sent in the BIOS' own form. If authorisation required add that to
+ * command. The command is built in the device's scratch buffer, so this
+ * is called with wmi_lock held.
+ */
+static int think_lmi_stage_setting(struct think_lmi *think,
+				   struct think_lmi_setting *setting,
+				   const char *value, const char *auth)
+{
+	char *cmd = think->set_cmd;
+	size_t len = sizeof(think->set_cmd);
+	int count;
+
+	if (*auth)
+		count = snprintf(cmd, len, "%s,%s,%s;", setting->wmi_name,
+				 value, auth);
+	else
+		count = snprintf(cmd, len, "%s,%s;", setting->wmi_name, value);
+	if (count >= len)
+		return -E2BIG;
+
+	return think_lmi_set_bios_settings(cmd);
+}
+
+/* Look up a setting by the first len bytes of name */
+static struct think_lmi_setting *think_lmi_find_setting(struct think_lmi *think,
+							const char *name,
+							size_t len)
+{
+	struct think_lmi_setting *setting;
+	u32 hash = full_name_hash(NULL, name, len);
 
-	if (*think->password_kbdlang) {
-		strcat(think->auth_string, ",");
-		strcat(think->auth_string, think->password_kbdlang);
+	hash_for_each_possible(think->setting_hash, setting, hnode, hash) {
+		if (setting->hash == hash &&
+		    !strncmp(setting->name, name, len) && !setting->name[len])
+			return setting;
 	}
+	/* No match found */
+	return NULL;
+}
+
+/*
+ * Settings are enumerated in the background. Callers needing the settings
+ * table wait for that to finish, or get -EAGAIN on a non-blocking open.
+ */
+static int think_lmi_wait_settings(struct think_lmi *think, struct file *filp)
+{
+	if (completion_done(&think->analyze_done))
+		return 0;
+	if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+	return wait_for_completion_interruptible(&think->analyze_done);
 }
 
-static int validate_setting_name(struct think_lmi *think, char* setting)
+/*
+ * Drop the cached value of a setting, or of all settings if setting is
+ * NULL, so the next read queries the BIOS again. Bumping cache_gen stops
+ * reads that were already in flight from caching what they got.
+ */
+static void think_lmi_invalidate_values(struct think_lmi *think,
+					struct think_lmi_setting *setting)
 {
 	int i;
-	for (i = 0; i <= TLMI_MAX_SETTINGS; i++) {
-		if (think->settings[i] != NULL) {
-			if (!strcmp(setting, think->settings[i]))
-					return i;
+
+	down_write(&think->cache_sem);
+	think->cache_gen++;
+	if (setting) {
+		kvfree(setting->value);
+		setting->value = NULL;
+	} else if (completion_done(&think->analyze_done)) {
+		for (i = 0; i < think->settings_size; i++) {
+			kvfree(think->settings[i].value);
+			think->settings[i].value = NULL;
 		}
 	}
-	/* No match found - return error condition */
-	return -EINVAL;
+	up_write(&think->cache_sem);
 }
 
-/* Character device open interface */
-static int think_lmi_chardev_open(struct inode *inode, struct file *file)
+static void think_lmi_choices_release(struct kref *ref)
 {
-	struct think_lmi *think;
-	think = container_of(inode->i_cdev, struct think_lmi, c_dev);
-	file->private_data = think;
-        return THINK_LMI_SUCCESS;
+	struct think_lmi_choices *choices =
+		container_of(ref, struct think_lmi_choices, ref);
+
+	hash_del(&choices->hnode);
+	kvfree(choices);
 }
 
-/* Character device ioctl interface */
-static long think_lmi_chardev_ioctl(struct file *filp, unsigned int cmd,
-					unsigned long arg)
+/*
+ * Drop a reference to an interned choice list. Called with cache_sem
+ * held for writing.
+ */
+static void think_lmi_put_choices(struct think_lmi_choices *choices)
 {
-        struct think_lmi *think;
-	int j,ret,item;
-	unsigned char settings_str[TLMI_SETTINGS_MAXLEN];
-	char get_set_string[TLMI_GETSET_MAXLEN];
-	char newpassword[TLMI_PWD_MAXLEN];
-	char *settings = NULL, *choices = NULL;
-	char *value;
-	char *tmp_string = NULL;
-	ssize_t count =0;
-
-	think = filp->private_data;
-	switch(cmd){
-	case THINKLMI_GET_SETTINGS:
-		if (copy_to_user((int *)arg, &think->settings_count,
-				 sizeof(think->settings_count)))
-			return -EFAULT;
-		break;
-	case THINKLMI_GET_SETTINGS_STRING:
-		/* Get the string for given index */
-		if (copy_from_user(settings_str, (void *)arg,
-				   sizeof(settings_str)))
-			return -EFAULT;
-		j = settings_str[0];
-		if ((j > TLMI_MAX_SETTINGS) || (!think->settings[j]))
-			return -EINVAL;
-		strncpy(settings_str, think->settings[j],
-				(TLMI_SETTINGS_MAXLEN-1));
-		if (copy_to_user((char *)arg, settings_str,
-				 sizeof(settings_str)))
-			return -EFAULT;
-		break;
-	case THINKLMI_SET_SETTING:
-		if (copy_from_user(get_set_string, (void *)arg,
-				   sizeof(get_set_string)))
-			return -EFAULT;
+	if (choices)
+		kref_put(&choices->ref, think_lmi_choices_release);
+}
 
-		/* First validate that this is a valid setting name */
-		value = strchr(get_set_string, ',');
-		if (!value) {
-			ret = -EINVAL;
-			goto error;
+/*
+ * Find or add the shared copy of a choice list and take a reference on
+ * it. Called with cache_sem held for writing.
+ */
+static struct think_lmi_choices *think_lmi_intern_choices(struct think_lmi *think,
+							  const char *str)
+{
+	struct think_lmi_choices *choices;
+	size_t len = strlen(str);
+	u32 hash = full_name_hash(NULL, str, len);
+
+	hash_for_each_possible(think->choices_hash, choices, hnode, hash) {
+		if (choices->hash == hash && !strcmp(choices->str, str)) {
+			kref_get(&choices->ref);
+			return choices;
 		}
-		tmp_string = kmalloc(value - get_set_string + 1, GFP_KERNEL);
-		snprintf(tmp_string, value - get_set_string + 1, "%s",
-			                get_set_string);
-		ret = validate_setting_name(think, tmp_string);
-		kfree(tmp_string);
-		if (ret < 0)
-			goto error;
+	}
 
-		/* If authorisation required add that to command */
-		if (*think->auth_string) {
-			count = strlen(get_set_string) +
-				strlen(think->auth_string) + 2;
-			tmp_string = kmalloc(count, GFP_KERNEL);
-			snprintf(tmp_string, count, "%s,%s;",
-					get_set_string, think->auth_string);
-		} else {
-			count =  strlen(get_set_string) + 1;
-			tmp_string = kmalloc(count, GFP_KERNEL);
-			snprintf(tmp_string, count, "%s;", get_set_string);
-		}
+	choices = think_lmi_alloc(1, struct_size(choices, str, len + 1),
+				  GFP_KERNEL);
+	if (!choices)
+		return NULL;
+	kref_init(&choices->ref);
+	choices->hash = hash;
+	memcpy(choices->str, str, len + 1);
+	hash_add(think->choices_hash, &choices->hnode, hash);
+	return choices;
+}
 
-		ret = think_lmi_set_bios_settings(tmp_string);
-		kfree(tmp_string);
+/*
+ * Check whether value is in a choice list. Lists that are not a plain
+ * enumeration, like boot order or ranges, are left for the BIOS to check.
+ */
+static bool think_lmi_value_allowed(const char *choices, const char *value,
+				    size_t len)
+{
+	const char *p = choices;
+	size_t n;
+
+	if (!*choices || strpbrk(choices, ":[") || strnchr(value, len, ':'))
+		return true;
+
+	while (*p) {
+		n = strcspn(p, ",");
+		if (n == len && !strncmp(p, value, len))
+			return true;
+		p += n;
+		if (*p)
+			p++;
+	}
+	return false;
+}
 
-		ret = think_lmi_save_bios_settings(think->auth_string);
-                if (ret) {
-			/* Try to discard the settings
-			 * if we failed to apply them */
-			think_lmi_discard_bios_settings(think->
-					         auth_string);
-			goto error;
-                }
-		break;
-	case THINKLMI_SHOW_SETTING:
-		item = -1;
-		if (copy_from_user(get_set_string, (void *)arg,
-				   sizeof(get_set_string)))
-			return -EFAULT;
-		item = validate_setting_name(think, get_set_string);
-		if (item < 0) { /* Invalid entry */
-			ret = -EINVAL;
-			goto error;
+/*
+ * Validate a new value against the cached choice list of a setting.
+ * Settings whose choices have not been read yet are not checked.
+ */
+static int think_lmi_check_value(struct think_lmi *think,
+				 struct think_lmi_setting *setting,
+				 const char *value)
+{
+	size_t len = strcspn(value, ",;");
+	int ret = 0;
+
+	down_read(&think->cache_sem);
+	if (setting->choices &&
+	    !think_lmi_value_allowed(setting->choices->str, value, len)) {
+		pr_debug("Invalid value '%.*s' for %s\n", (int)len, value,
+			 setting->name);
+		ret = -EINVAL;
+	}
+	up_read(&think->cache_sem);
+	return ret;
+}
+
+/*
+ * Check that a value read from the BIOS is for the setting we asked about.
+ * This can only fail if the settings list came from a snapshot that no
+ * longer matches the BIOS, or the BIOS was updated while hibernated, and
+ * then no value is trusted.
+ */
+static bool think_lmi_item_is(const char *value, const char *wmi_name)
+{
+	size_t len = strlen(wmi_name);
+
+	return !strncmp(value, wmi_name, len) &&
+	       (value[len] == ',' || value[len] == '\0');
+}
+
+static int think_lmi_check_item(struct think_lmi *think,
+				struct think_lmi_setting *setting,
+				const char *value)
+{
+	if (think_lmi_item_is(value, setting->wmi_name))
+		return 0;
+
+	if (think->from_snapshot)
+		pr_warn_once("settings snapshot doesn't match the BIOS, remove %s\n",
+			     TLMI_SNAPSHOT_FW);
+	else
+		pr_warn_once("settings list doesn't match the BIOS, reload the driver\n");
+	return -EIO;
+}
+
+/*
+ * Drop every cached value if the system has resumed since it was read,
+ * and mark the settings that had one for the resume work to read again.
+ * This is one atomic read when nothing has changed.
+ */
+static void think_lmi_check_resume(struct think_lmi *think)
+{
+	int epoch = atomic_read(&think->resume_epoch);
+	int i, n;
+
+	if (likely(READ_ONCE(think->values_epoch) == epoch))
+		return;
+
+	down_write(&think->cache_sem);
+	if (think->values_epoch != epoch) {
+		think->cache_gen++;
+		/* Enumeration caches no values, so there is nothing before it */
+		n = completion_done(&think->analyze_done) ?
+		    think->settings_size : 0;
+		for (i = 0; i < n; i++) {
+			if (!think->settings[i].value)
+				continue;
+			kvfree(think->settings[i].value);
+			think->settings[i].value = NULL;
+			WRITE_ONCE(think->settings[i].rewarm, true);
 		}
-		/* Do a WMI query for the settings */
-		ret = think_lmi_setting(item, &settings,
-				          LENOVO_BIOS_SETTING_GUID);
-		if (ret)
-			goto error;
+		WRITE_ONCE(think->values_epoch, epoch);
+	}
+	up_write(&think->cache_sem);
+}
 
-		if (think->can_get_bios_selections)
-		{
-			ret = think_lmi_get_bios_selections(get_set_string,
-						    &choices);
-			if (ret)
-				goto error;
-			if (choices) {
-				value = strchr(settings, ',');
-				if (!value)
-					goto error;
-				value++;
-				/* Allocate enough space for value,
-				 * choices, return chars and
-				 * null terminate
-				 */
-				tmp_string = (char *)kmalloc(strlen(value)
-					        + strlen(choices) + 5,
-						      GFP_KERNEL);
-				count = sprintf(tmp_string, "%s\n", value);
-				count += sprintf(tmp_string + count,
-						"%s\n",	choices);
-			}
-		} else {
-			/* BIOS doesn't support choices
-			 * option - it's all in one string */
-			tmp_string = (char *)kmalloc(strlen(settings)
-				           + 3, GFP_KERNEL);
-			count = sprintf(tmp_string, "%s\n", settings);
+/*
+ * Read whatever the cache lacks of a setting's value and choices, or both
+ * if refresh is set, and add it to the cache. The choice list doesn't
+ * change while the system is up, so it is normally only fetched once.
+ * The BIOS is queried without cache_sem held so cached readers never
+ * wait for it.
+ */
+static int think_lmi_fill_cache(struct think_lmi *think,
+				struct think_lmi_setting *setting,
+				bool refresh)
+{
+	struct think_lmi_choices *choices;
+	char *value = NULL, *str = NULL;
+	bool need_value, need_choices;
+	unsigned long gen;
+	int ret = 0;
+
+	think_lmi_check_resume(think);
+
+	down_read(&think->cache_sem);
+	need_value = refresh || !setting->value;
+	need_choices = think->can_get_bios_selections &&
+		       (refresh || !setting->choices);
+	gen = think->cache_gen;
+	up_read(&think->cache_sem);
+
+	if (need_value) {
+		/* Do a WMI query for the settings */
+		ret = think_lmi_setting(setting->index, &value,
+					LENOVO_BIOS_SETTING_GUID);
+		if (!ret)
+			ret = think_lmi_check_item(think, setting, value);
+		if (ret) {
+			kvfree(value);
+			return ret;
 		}
-		if (count > TLMI_SETTINGS_MAXLEN) {
-			/* Unlikely to happen - but if the string is going
-			 * to overflow the amount of space that is
+	}
+	if (need_choices) {
+		ret = think_lmi_get_bios_selections(setting->wmi_name, &str);
+		if (ret) {
+			kvfree(value);
+			return ret;
+		}
+	}
+
+	down_write(&think->cache_sem);
+	/* A value read across an invalidation may already be stale */
+	if (value && think->cache_gen == gen) {
+		kvfree(setting->value);
+		setting->value = value;
+		value = NULL;
+	}
+	if (str) {
+		choices = think_lmi_intern_choices(think, str);
+		if (choices) {
+			think_lmi_put_choices(setting->choices);
+			setting->choices = choices;
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+	up_write(&think->cache_sem);
+
+	kvfree(value);
+	kvfree(str);
+	return ret;
+}
+
+/*
+ * Get the current value of a setting and its choices, or NULL choices if
+ * the BIOS can't list them. Both are served from the cache unless refresh
+ * is set or they have been invalidated. On success this returns with
+ * cache_sem held for reading. The strings belong to the cache and may
+ * only be used until the caller releases it.
+ */
+static int think_lmi_lock_strings(struct think_lmi *think,
+				  struct think_lmi_setting *setting,
+				  bool refresh, const char **value,
+				  const char **choices)
+{
+	int ret;
+
+	for (;;) {
+		ret = think_lmi_fill_cache(think, setting, refresh);
+		if (ret)
+			return ret;
+		refresh = false;
+
+		down_read(&think->cache_sem);
+		if (setting->value &&
+		    (setting->choices || !think->can_get_bios_selections))
+			break;
+		/* Invalidated again before we got here */
+		up_read(&think->cache_sem);
+	}
+
+	if (!think->can_get_bios_selections) {
+		/* BIOS doesn't support choices
+		 * option - it's all in one string */
+		*value = setting->value;
+		*choices = NULL;
+		return 0;
+	}
+
+	*value = strchr(setting->value, ',');
+	if (!*value) {
+		up_read(&think->cache_sem);
+		return -EIO;
+	}
+	(*value)++;
+	*choices = setting->choices->str;
+	return 0;
+}
+
+/*
+ * Format the current value of a setting and its choices into buf.
+ * Returns the number of bytes needed, including the terminating NUL.
+ * If that is more than size the output is truncated.
+ */
+static ssize_t think_lmi_show_setting(struct think_lmi *think,
+				      struct think_lmi_setting *setting,
+				      bool refresh, char *buf, size_t size)
+{
+	const char *value, *choices;
+	ssize_t count;
+	int ret;
+
+	ret = think_lmi_lock_strings(think, setting, refresh, &value, &choices);
+	if (ret)
+		return ret;
+
+	if (choices)
+		count = snprintf(buf, size, "%s\n%s\n", value, choices);
+	else
+		count = snprintf(buf, size, "%s\n", value);
+	up_read(&think->cache_sem);
+
+	/* Replace the final newline with the terminator */
+	if (count <= size)
+		buf[count - 1] = '\0';
+	return count;
+}
+
+/*
+ * As think_lmi_show_setting(), but copy straight from the cache to the
+ * output of a v2 request, so long choice lists need no bounce buffer.
+ */
+static int think_lmi_show_setting_v2(struct think_lmi *think,
+				     struct think_lmi_setting *setting,
+				     bool refresh, struct tlmi_buf *req,
+				     unsigned long arg)
+{
+	struct tlmi_buf *ureq = (struct tlmi_buf *)arg;
+	char *out = u64_to_user_ptr(req->out);
+	const char *value, *choices;
+	size_t value_len, len;
+	char sep;
+	int ret;
+
+	ret = think_lmi_lock_strings(think, setting, refresh, &value, &choices);
+	if (ret)
+		return ret;
+
+	/* "value\nchoices" or just "value", NUL terminated */
+	value_len = strlen(value);
+	len = value_len + 1 + (choices ? strlen(choices) + 1 : 0);
+	sep = choices ? '\n' : '\0';
+	if (len > req->out_len)
+		ret = -ENOSPC;
+	else if (copy_to_user(out, value, value_len) ||
+		 copy_to_user(out + value_len, &sep, 1) ||
+		 (choices && copy_to_user(out + value_len + 1, choices,
+					  len - value_len - 1)))
+		ret = -EFAULT;
+	up_read(&think->cache_sem);
+	if (ret == -EFAULT)
+		return ret;
+
+	req->out_len = len;
+	if (copy_to_user(&ureq->out_len, &req->out_len, sizeof(req->out_len)))
+		return -EFAULT;
+	return ret;
+}
+
+/*
+ * Copy one THINKLMI_GET_VEC record to buf. Called with cache_sem held,
+ * as value and choices may point into the cache.
+ */
+static int think_lmi_put_record(char *buf, struct tlmi_vec_record *rec,
+				const char *name, const char *value,
+				const char *choices)
+{
+	size_t off = sizeof(*rec);
+
+	if (copy_to_user(buf, rec, sizeof(*rec)) ||
+	    copy_to_user(buf + off, name, rec->name_len))
+		return -EFAULT;
+	off += rec->name_len;
+	if (copy_to_user(buf + off, value, rec->value_len))
+		return -EFAULT;
+	off += rec->value_len;
+	if (copy_to_user(buf + off, choices, rec->choices_len))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Read many settings in one call. Records are packed into the caller's
+ * buffer in request order until it is full. The size needed for all of
+ * them is always reported so callers can retry after -ENOSPC.
+ */
+static long think_lmi_get_vec(struct think_lmi *think, unsigned long arg)
+{
+	struct tlmi_get_vec vec;
+	struct tlmi_vec_record rec;
+	struct think_lmi_setting *setting;
+	const char *value = NULL, *choices = NULL;
+	char name[TLMI_SETTINGS_MAXLEN];
+	char *names = NULL;
+	__s32 *indices;
+	char *buf;
+	size_t off = 0, name_off = 0, size;
+	long len;
+	bool full = false;
+	unsigned int i;
+	__s32 index;
+	int ret = 0;
+
+	if (copy_from_user(&vec, (void *)arg, sizeof(vec)))
+		return -EFAULT;
+	if (vec.count > TLMI_VEC_MAX ||
+	    vec.flags & ~(TLMI_VEC_BY_NAME | TLMI_VEC_REFRESH))
+		return -EINVAL;
+
+	if (vec.flags & TLMI_VEC_BY_NAME) {
+		if (!vec.keys_len ||
+		    vec.keys_len > TLMI_VEC_MAX * TLMI_SETTINGS_MAXLEN)
+			return -EINVAL;
+		/* Names are copied in one at a time as they are looked up */
+		names = u64_to_user_ptr(vec.keys);
+	}
+	indices = u64_to_user_ptr(vec.keys);
+	buf = u64_to_user_ptr(vec.buf);
+
+	vec.done = 0;
+	for (i = 0; i < vec.count; i++) {
+		setting = NULL;
+		if (names) {
+			size = min_t(size_t, sizeof(name),
+				     vec.keys_len - name_off);
+			len = size ? strncpy_from_user(name, names + name_off,
+						       size) : 0;
+			if (len < 0)
+				return len;
+			/* Missing, unterminated or too long */
+			if (len == size)
+				return -EINVAL;
+			setting = think_lmi_find_setting(think, name, len);
+			name_off += len + 1;
+		} else {
+			if (copy_from_user(&index, indices + i, sizeof(index)))
+				return -EFAULT;
+			if (index >= 0 && index < think->settings_size &&
+			    think->settings[index].name)
+				setting = &think->settings[index];
+		}
+
+		memset(&rec, 0, sizeof(rec));
+		rec.index = setting ? setting->index : -1;
+		rec.status = -EINVAL;
+
+		if (setting)
+			rec.status = think_lmi_lock_strings(think, setting,
+						vec.flags & TLMI_VEC_REFRESH,
+						&value, &choices);
+		if (!rec.status) {
+			rec.name_len = strlen(setting->name) + 1;
+			rec.value_len = strlen(value) + 1;
+			rec.choices_len = choices ? strlen(choices) + 1 : 0;
+		}
+		size = TLMI_VEC_RECORD_SIZE(&rec);
+		if (!full && off + size <= vec.buf_len) {
+			ret = think_lmi_put_record(buf + off, &rec,
+						   setting ? setting->name : NULL,
+						   value, choices);
+			vec.done++;
+		} else {
+			full = true;
+		}
+		if (!rec.status)
+			up_read(&think->cache_sem);
+		if (ret)
+			return ret;
+		off += size;
+	}
+
+	vec.needed = off;
+	if (full)
+		ret = -ENOSPC;
+	if (copy_to_user((void *)arg, &vec, sizeof(vec)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Record a successful change, wake readers watching for changes and send
+ * SIGIO to the watching files that asked for it. settings lists what was
+ * changed, if known. Called with wmi_lock held.
+ */
+static void think_lmi_notify_change(struct think_lmi *think, u32 reason,
+				    struct think_lmi_setting **settings,
+				    unsigned int count)
+{
+	struct think_lmi_change *change;
+	struct think_lmi_file *ctx;
+	unsigned int i;
+
+	mutex_lock(&think->change_lock);
+	think->change_gen++;
+	change = &think->changes[think->change_gen % TLMI_CHANGE_RING];
+	change->gen = think->change_gen;
+	change->reason = reason;
+	change->count = count;
+	for (i = 0; i < count; i++)
+		change->index[i] = settings[i]->index;
+	list_for_each_entry(ctx, &think->watchers, watch_node)
+		kill_fasync(&ctx->fasync, SIGIO, POLL_IN);
+	mutex_unlock(&think->change_lock);
+
+	wake_up_interruptible(&think->event_wait);
+}
+
+/*
+ * Set and save one "Item,Value" string. If the value is not one of the
+ * setting's choices, -EINVAL is returned and *refused is set to the
+ * setting, so the caller can hand its choices back. Called with wmi_lock
+ * held.
+ */
+static int think_lmi_apply_setting(struct think_lmi *think, const char *auth,
+				   const char *str,
+				   struct think_lmi_setting **refused)
+{
+	struct think_lmi_setting *setting;
+	const char *value;
+	int ret;
+
+	*refused = NULL;
+
+	/* First validate that this is a valid setting name */
+	value = strchr(str, ',');
+	if (!value)
+		return -EINVAL;
+	setting = think_lmi_find_setting(think, str, value - str);
+	if (!setting)
+		return -EINVAL;
+
+	/*
+	 * Refuse values that are not in the choice list without calling
+	 * into the BIOS, and hand the list back instead.
+	 */
+	ret = think_lmi_check_value(think, setting, value + 1);
+	if (ret) {
+		*refused = setting;
+		return ret;
+	}
+
+	ret = think_lmi_stage_setting(think, setting, value + 1, auth);
+	if (!ret)
+		ret = think_lmi_save_bios_settings(auth);
+	if (ret) {
+		/* Try to discard the settings
+		 * if we failed to apply them */
+		think_lmi_discard_bios_settings(auth);
+		think_lmi_invalidate_values(think, NULL);
+		return ret;
+	}
+	think_lmi_invalidate_values(think, setting);
+	think_lmi_notify_change(think, TLMI_CHANGE_SET, &setting, 1);
+	return 0;
+}
+
+/*
+ * Apply a list of settings with a single save. All names and values are
+ * checked before anything is sent to the BIOS. If staging any of them
+ * fails, the pending changes are discarded and the rest are not tried.
+ */
+static long think_lmi_batch_set(struct think_lmi *think, const char *auth,
+				unsigned long arg)
+{
+	struct tlmi_batch_set batch;
+	struct tlmi_setting_pair *items, *uitems;
+	struct think_lmi_setting **settings = NULL;
+	unsigned int i;
+	int ret = 0;
+
+	if (copy_from_user(&batch, (void *)arg, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.count || batch.count > TLMI_BATCH_MAX)
+		return -EINVAL;
+
+	uitems = u64_to_user_ptr(batch.items);
+	items = think_lmi_alloc(batch.count, sizeof(*items), GFP_KERNEL);
+	if (!items)
+		return -ENOMEM;
+	settings = think_lmi_alloc(batch.count, sizeof(*settings),
+				   GFP_KERNEL | __GFP_ZERO);
+	if (!settings) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(items, uitems, batch.count * sizeof(*items))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	batch.failed = -1;
+	for (i = 0; i < batch.count; i++) {
+		items[i].name[TLMI_SETTINGS_MAXLEN - 1] = '\0';
+		items[i].value[TLMI_SETTINGS_MAXLEN - 1] = '\0';
+		items[i].status = -ECANCELED;
+	}
+
+	/* Check everything up front so nothing is staged on bad input */
+	for (i = 0; i < batch.count; i++) {
+		settings[i] = think_lmi_find_setting(think, items[i].name,
+						     strlen(items[i].name));
+		if (!settings[i] ||
+		    think_lmi_check_value(think, settings[i], items[i].value)) {
+			items[i].status = -EINVAL;
+			batch.failed = i;
+			ret = -EINVAL;
+			goto report;
+		}
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		ret = think_lmi_stage_setting(think, settings[i], items[i].value,
+					      auth);
+		items[i].status = ret;
+		if (ret) {
+			batch.failed = i;
+			break;
+		}
+	}
+
+	if (!ret) {
+		ret = think_lmi_save_bios_settings(auth);
+		if (ret) {
+			/* The save covers every item */
+			batch.failed = batch.count;
+			for (i = 0; i < batch.count; i++)
+				items[i].status = ret;
+		}
+	}
+
+	if (ret) {
+		think_lmi_discard_bios_settings(auth);
+		think_lmi_invalidate_values(think, NULL);
+	} else {
+		for (i = 0; i < batch.count; i++)
+			think_lmi_invalidate_values(think, settings[i]);
+		think_lmi_notify_change(think, TLMI_CHANGE_SET, settings,
+					batch.count);
+	}
+
+report:
+	for (i = 0; i < batch.count; i++) {
+		if (copy_to_user(&uitems[i].status, &items[i].status,
+				 sizeof(items[i].status)))
+			ret = -EFAULT;
+	}
+	if (copy_to_user((void *)arg, &batch, sizeof(batch)))
+		ret = -EFAULT;
+out:
+	kvfree(settings);
+	kvfree(items);
+	return ret;
+}
+
+/* A Lenovo_lmiopcode directive, see struct tlmi_opcode */
+struct think_lmi_opcode {
+	const char *opcode;
+	const char *arg;
+	u32 flags;
+	int status;
+};
+
+static bool think_lmi_opcode_valid(const struct think_lmi_opcode *op)
+{
+	const char *p;
+
+	if (!*op->opcode || strchr(op->arg, ';') ||
+	    op->flags & ~TLMI_OPCODE_NO_ARG ||
+	    (op->flags & TLMI_OPCODE_NO_ARG && *op->arg) ||
+	    strlen(op->opcode) + strlen(op->arg) + sizeof("WmiOpcode:;") >
+	    TLMI_SET_CMD_MAXLEN)
+		return false;
+	for (p = op->opcode; *p; p++) {
+		if (!isalnum(*p))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Send a sequence of lmiopcode directives and save if asked, reporting
+ * as struct tlmi_opcode_seq describes. Nothing is sent unless all of them
+ * are well formed. Values are dropped from the cache once anything was
+ * sent, as opcodes can change settings. The directives are built in the
+ * device's scratch buffer, so this is called with wmi_lock held.
+ */
+static int think_lmi_run_opcodes(struct think_lmi *think, const char *auth,
+				 struct think_lmi_opcode *ops,
+				 unsigned int count, bool save, u32 reason,
+				 s32 *failed)
+{
+	unsigned int i;
+	int ret = 0;
+
+	*failed = -1;
+	for (i = 0; i < count; i++)
+		ops[i].status = -ECANCELED;
+	for (i = 0; i < count; i++) {
+		if (!think_lmi_opcode_valid(&ops[i])) {
+			ops[i].status = -EINVAL;
+			*failed = i;
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].flags & TLMI_OPCODE_NO_ARG)
+			snprintf(think->set_cmd, sizeof(think->set_cmd),
+				 "WmiOpcode%s;", ops[i].opcode);
+		else
+			snprintf(think->set_cmd, sizeof(think->set_cmd),
+				 "WmiOpcode%s:%s;", ops[i].opcode, ops[i].arg);
+		ret = think_lmi_set_lmiopcode_settings(think->set_cmd);
+		ops[i].status = ret;
+		if (ret) {
+			*failed = i;
+			break;
+		}
+	}
+	if (!ret && save) {
+		ret = think_lmi_save_bios_settings(auth);
+		if (ret)
+			*failed = count;
+	}
+
+	/* Don't leave the first steps of a failed sequence pending */
+	if (ret && *failed > 0)
+		think_lmi_discard_bios_settings(auth);
+	think_lmi_invalidate_values(think, NULL);
+	if (!ret)
+		think_lmi_notify_change(think, reason, NULL, 0);
+	return ret;
+}
+
+/*
+ * Changes named after passwords or the TPM are reported as such. The
+ * PasswordAdmin step only authenticates the rest, so it doesn't count,
+ * and a TPM step wins over password steps.
+ */
+static u32 think_lmi_opcode_reason(const struct think_lmi_opcode *ops,
+				   unsigned int count)
+{
+	u32 reason = TLMI_CHANGE_SET;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!strcmp(ops[i].opcode, "TPM"))
+			return TLMI_CHANGE_TPM;
+		if (strcmp(ops[i].opcode, "PasswordAdmin") &&
+		    !strncmp(ops[i].opcode, "Password", strlen("Password")))
+			reason = TLMI_CHANGE_PASSWORD;
+	}
+	return reason;
+}
+
+static long think_lmi_opcode_seq(struct think_lmi *think, const char *auth,
+				 unsigned long arg)
+{
+	struct think_lmi_opcode ops[TLMI_OPCODE_SEQ_MAX];
+	struct tlmi_opcode *steps, *usteps;
+	struct tlmi_opcode_seq seq;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&seq, (void *)arg, sizeof(seq)))
+		return -EFAULT;
+	if (!seq.count || seq.count > TLMI_OPCODE_SEQ_MAX ||
+	    seq.flags & ~TLMI_OPCODE_SAVE)
+		return -EINVAL;
+
+	usteps = u64_to_user_ptr(seq.steps);
+	steps = think_lmi_alloc(seq.count, sizeof(*steps), GFP_KERNEL);
+	if (!steps)
+		return -ENOMEM;
+	if (copy_from_user(steps, usteps, seq.count * sizeof(*steps))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < seq.count; i++) {
+		steps[i].opcode[TLMI_OPCODE_MAXLEN - 1] = '\0';
+		steps[i].arg[TLMI_SETTINGS_MAXLEN - 1] = '\0';
+		ops[i].opcode = steps[i].opcode;
+		ops[i].arg = steps[i].arg;
+		ops[i].flags = steps[i].flags;
+	}
+	ret = think_lmi_run_opcodes(think, auth, ops, seq.count,
+				    seq.flags & TLMI_OPCODE_SAVE,
+				    think_lmi_opcode_reason(ops, seq.count),
+				    &seq.failed);
+
+	for (i = 0; i < seq.count; i++) {
+		if (copy_to_user(&usteps[i].status, &ops[i].status,
+				 sizeof(usteps[i].status)))
+			ret = -EFAULT;
+	}
+	if (copy_to_user((void *)arg, &seq, sizeof(seq)))
+		ret = -EFAULT;
+out:
+	kvfree(steps);
+	return ret;
+}
+
+/* Callers of the v1 opcode commands end the last field with its ';' */
+static void think_lmi_strip_terminator(char *str)
+{
+	size_t len = strlen(str);
+
+	if (len && str[len - 1] == ';')
+		str[len - 1] = '\0';
+}
+
+/*
+ * THINKLMI_LMIOPCODE: "Admin,Type,Current,New;" changes a password with
+ * five directives. The credentials are kept only if all of them succeed.
+ */
+static int think_lmi_opcode_password(struct think_lmi_file *ctx, char *str)
+{
+	struct think_lmi_opcode ops[] = {
+		{ .opcode = "PasswordAdmin" },
+		{ .opcode = "PasswordType" },
+		{ .opcode = "PasswordCurrent01" },
+		{ .opcode = "PasswordNew01" },
+		{ .opcode = "PasswordSetUpdate", .arg = "",
+		  .flags = TLMI_OPCODE_NO_ARG },
+	};
+	char *field = NULL;
+	s32 failed;
+	int i, ret;
+
+	for (i = 0; i < 4; i++) {
+		field = strsep(&str, ",");
+		if (!field)
+			return -EFAULT;
+		ops[i].arg = field;
+	}
+	think_lmi_strip_terminator(field);
+
+	ret = think_lmi_run_opcodes(ctx->think, ctx->auth_string, ops,
+				    ARRAY_SIZE(ops), false,
+				    TLMI_CHANGE_PASSWORD, &failed);
+	if (ret)
+		return ret;
+
+	snprintf(ctx->password, TLMI_PWD_MAXLEN, "%s", ops[0].arg);
+	snprintf(ctx->password_type, TLMI_PWDTYPE_MAXLEN, "%s", ops[1].arg);
+	snprintf(ctx->passcurr, TLMI_PWD_MAXLEN, "%s", ops[2].arg);
+	snprintf(ctx->passnew, TLMI_PWD_MAXLEN, "%s", ops[3].arg);
+	return 0;
+}
+
+/* THINKLMI_TPMTYPE: "Type;" switches the TPM type and saves */
+static int think_lmi_opcode_tpm(struct think_lmi_file *ctx, char *str)
+{
+	struct think_lmi_opcode op = { .opcode = "TPM", .arg = str };
+	s32 failed;
+
+	think_lmi_strip_terminator(str);
+	return think_lmi_run_opcodes(ctx->think, ctx->auth_string, &op, 1,
+				     true, TLMI_CHANGE_TPM, &failed);
+}
+
+/* v2 commands and the v1 command each of them behaves like */
+static const unsigned int think_lmi_v2_cmds[][2] = {
+	{ THINKLMI_GET_SETTINGS_STRING_V2, THINKLMI_GET_SETTINGS_STRING },
+	{ THINKLMI_SET_SETTING_V2,	   THINKLMI_SET_SETTING },
+	{ THINKLMI_SHOW_SETTING_V2,	   THINKLMI_SHOW_SETTING },
+	{ THINKLMI_REFRESH_SETTING_V2,	   THINKLMI_REFRESH_SETTING },
+	{ THINKLMI_AUTHENTICATE_V2,	   THINKLMI_AUTHENTICATE },
+	{ THINKLMI_CHANGE_PASSWORD_V2,	   THINKLMI_CHANGE_PASSWORD },
+	{ THINKLMI_DEBUG_V2,		   THINKLMI_DEBUG },
+	{ THINKLMI_LMIOPCODE_V2,	   THINKLMI_LMIOPCODE },
+	{ THINKLMI_TPMTYPE_V2,		   THINKLMI_TPMTYPE },
+};
+
+static unsigned int think_lmi_v2_to_v1(unsigned int cmd)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(think_lmi_v2_cmds); i++) {
+		if (think_lmi_v2_cmds[i][0] == cmd)
+			return think_lmi_v2_cmds[i][1];
+	}
+	return 0;
+}
+
+/* Size of the fixed input buffer of a v1 command, 0 if it takes none */
+static size_t think_lmi_v1_in_size(unsigned int cmd)
+{
+	switch (cmd) {
+	case THINKLMI_GET_SETTINGS_STRING:
+		return TLMI_SETTINGS_MAXLEN;
+	case THINKLMI_SET_SETTING:
+	case THINKLMI_SHOW_SETTING:
+	case THINKLMI_REFRESH_SETTING:
+	case THINKLMI_AUTHENTICATE:
+	case THINKLMI_CHANGE_PASSWORD:
+	case THINKLMI_DEBUG:
+	case THINKLMI_LMIOPCODE:
+	case THINKLMI_TPMTYPE:
+		return TLMI_GETSET_MAXLEN;
+	}
+	return 0;
+}
+
+/*
+ * Copy a result back to userspace. v1 requests write into the buffer at
+ * arg. v2 requests only copy what is used, and report the size needed
+ * with -ENOSPC if the caller's buffer is too small.
+ */
+static int think_lmi_copy_out(struct tlmi_buf *req, unsigned long arg,
+			      const void *data, size_t len)
+{
+	struct tlmi_buf *ureq = (struct tlmi_buf *)arg;
+	int ret = 0;
+
+	if (!req)
+		return copy_to_user((void *)arg, data, len) ? -EFAULT : 0;
+
+	if (len > req->out_len)
+		ret = -ENOSPC;
+	else if (copy_to_user(u64_to_user_ptr(req->out), data, len))
+		return -EFAULT;
+
+	req->out_len = len;
+	if (copy_to_user(&ureq->out_len, &req->out_len, sizeof(req->out_len)))
+		return -EFAULT;
+	return ret;
+}
+
+/*
+ * Return the choice list of a setting whose value was refused. v1
+ * requests get it cut to fit buf, their fixed size buffer. v2 requests
+ * get all of it, or -ENOSPC with the size needed. The list is copied
+ * under cache_sem, as it lives in the cache.
+ */
+static int think_lmi_copy_choices(struct think_lmi *think,
+				  struct think_lmi_setting *setting,
+				  struct tlmi_buf *req, unsigned long arg,
+				  char *buf, size_t size)
+{
+	const char *choices;
+	int ret = 0;
+
+	down_read(&think->cache_sem);
+	if (setting->choices) {
+		choices = setting->choices->str;
+		if (!req) {
+			strscpy(buf, choices, size);
+			choices = buf;
+		}
+		ret = think_lmi_copy_out(req, arg, choices,
+					 strlen(choices) + 1);
+	}
+	up_read(&think->cache_sem);
+	return ret;
+}
+
+/*
+ * Format a setting into a buffer allocated to fit. Returns its length
+ * including the NUL, or a negative errno.
+ */
+static ssize_t think_lmi_show_alloc(struct think_lmi *think,
+				    struct think_lmi_setting *setting,
+				    bool refresh, char **buf)
+{
+	ssize_t size = TLMI_GETSET_MAXLEN;
+	ssize_t count;
+
+	for (;;) {
+		*buf = think_lmi_alloc(1, size, GFP_KERNEL);
+		if (!*buf)
+			return -ENOMEM;
+		count = think_lmi_show_setting(think, setting, refresh,
+					       *buf, size);
+		if (count > 0 && count <= size)
+			return count;
+		kvfree(*buf);
+		*buf = NULL;
+		if (count < 0)
+			return count;
+		/* Grew since the first try, the cache has it now */
+		size = count;
+		refresh = false;
+	}
+}
+
+/*
+ * An asynchronous request, on its file's pending list until it runs and
+ * then on its done list for read()
+ */
+struct think_lmi_async {
+	struct list_head node;
+	struct think_lmi_file *ctx;
+	u64 ticket;
+	u32 op;
+	int status;
+	char *in;
+	char *out;	/* Result for the caller, NULL if none */
+	size_t out_len;
+};
+
+static void think_lmi_async_free(struct think_lmi_async *req)
+{
+	kvfree(req->in);
+	kvfree(req->out);
+	kvfree(req);
+}
+
+static void think_lmi_file_free(struct kref *ref)
+{
+	struct think_lmi_file *ctx = container_of(ref, struct think_lmi_file,
+						  ref);
+	struct think_lmi_async *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &ctx->done, node)
+		think_lmi_async_free(req);
+	if (ctx->eventfd)
+		eventfd_ctx_put(ctx->eventfd);
+
+	/* Don't leave this session's passwords behind in freed memory */
+	memzero_explicit(ctx, sizeof(*ctx));
+	kfree(ctx);
+}
+
+static void think_lmi_async_complete(struct think_lmi_async *req)
+{
+	struct think_lmi_file *ctx = req->ctx;
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&req->node, &ctx->done);
+	if (ctx->eventfd)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0))
+		eventfd_signal(ctx->eventfd);
+#else
+		eventfd_signal(ctx->eventfd, 1);
+#endif
+	spin_unlock(&ctx->lock);
+	wake_up_interruptible(&ctx->think->event_wait);
+
+	kref_put(&ctx->ref, think_lmi_file_free);
+}
+
+static void think_lmi_async_run(struct think_lmi_async *req)
+{
+	struct think_lmi_file *ctx = req->ctx;
+	struct think_lmi *think = ctx->think;
+	struct think_lmi_setting *setting;
+	ssize_t count;
+
+	switch (req->op) {
+	case TLMI_ASYNC_SHOW:
+	case TLMI_ASYNC_REFRESH:
+		setting = think_lmi_find_setting(think, req->in,
+						 strlen(req->in));
+		if (!setting) {
+			req->status = -EINVAL;
+			break;
+		}
+		count = think_lmi_show_alloc(think, setting,
+					     req->op == TLMI_ASYNC_REFRESH,
+					     &req->out);
+		if (count < 0)
+			req->status = count;
+		else
+			req->out_len = count;
+		break;
+	case TLMI_ASYNC_SET:
+		mutex_lock(&think->wmi_lock);
+		req->status = think_lmi_apply_setting(think, ctx->auth_string,
+						      req->in, &setting);
+		/* Only a refused value returns anything: all of its choices */
+		if (req->status == -EINVAL && setting) {
+			down_read(&think->cache_sem);
+			if (setting->choices)
+				req->out = think_lmi_strdup(
+						setting->choices->str);
+			up_read(&think->cache_sem);
+			if (req->out)
+				req->out_len = strlen(req->out) + 1;
+		}
+		mutex_unlock(&think->wmi_lock);
+		break;
+	case TLMI_ASYNC_SAVE:
+		mutex_lock(&think->wmi_lock);
+		req->status = think_lmi_save_bios_settings(ctx->auth_string);
+		if (!req->status)
+			think_lmi_notify_change(think, TLMI_CHANGE_SAVE,
+						NULL, 0);
+		mutex_unlock(&think->wmi_lock);
+		break;
+	}
+
+	think_lmi_async_complete(req);
+}
+
+/*
+ * Run a file's requests one at a time in the order they were submitted,
+ * so a request sees the effect of those before it. Different files run
+ * in parallel.
+ */
+static void think_lmi_file_work(struct work_struct *work)
+{
+	struct think_lmi_file *ctx = container_of(work, struct think_lmi_file,
+						  work);
+	struct think_lmi_async *req;
+
+	for (;;) {
+		spin_lock(&ctx->lock);
+		req = list_first_entry_or_null(&ctx->pending,
+					       struct think_lmi_async, node);
+		if (req)
+			list_del(&req->node);
+		spin_unlock(&ctx->lock);
+		if (!req)
+			break;
+		think_lmi_async_run(req);
+	}
+
+	kref_put(&ctx->ref, think_lmi_file_free);
+}
+
+/* Queue an asynchronous request and return its ticket */
+static long think_lmi_async_submit(struct think_lmi_file *ctx,
+				   unsigned long arg)
+{
+	struct tlmi_async_req *ureq = (struct tlmi_async_req *)arg;
+	struct tlmi_async_req areq;
+	struct think_lmi_async *req;
+	int ret;
+
+	if (copy_from_user(&areq, ureq, sizeof(areq)))
+		return -EFAULT;
+	if (areq.op < TLMI_ASYNC_SHOW || areq.op > TLMI_ASYNC_SAVE ||
+	    areq.in_len >= TLMI_GETSET_MAXLEN)
+		return -EINVAL;
+
+	req = think_lmi_alloc(1, sizeof(*req), GFP_KERNEL | __GFP_ZERO);
+	if (!req)
+		return -ENOMEM;
+	req->in = think_lmi_alloc(1, areq.in_len + 1, GFP_KERNEL);
+	if (!req->in) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	if (copy_from_user(req->in, u64_to_user_ptr(areq.in), areq.in_len)) {
+		ret = -EFAULT;
+		goto error;
+	}
+	req->in[areq.in_len] = '\0';
+	req->ctx = ctx;
+	req->op = areq.op;
+
+	spin_lock(&ctx->lock);
+	if (ctx->async_count >= TLMI_ASYNC_MAX) {
+		spin_unlock(&ctx->lock);
+		ret = -EBUSY;
+		goto error;
+	}
+	ctx->async_count++;
+	req->ticket = ++ctx->next_ticket;
+	spin_unlock(&ctx->lock);
+
+	if (copy_to_user(&ureq->ticket, &req->ticket, sizeof(req->ticket))) {
+		spin_lock(&ctx->lock);
+		ctx->async_count--;
+		spin_unlock(&ctx->lock);
+		ret = -EFAULT;
+		goto error;
+	}
+
+	kref_get(&ctx->ref);
+	spin_lock(&ctx->lock);
+	list_add_tail(&req->node, &ctx->pending);
+	spin_unlock(&ctx->lock);
+	kref_get(&ctx->ref);
+	if (!queue_work(ctx->think->async_wq, &ctx->work))
+		kref_put(&ctx->ref, think_lmi_file_free);
+	return 0;
+
+error:
+	think_lmi_async_free(req);
+	return ret;
+}
+
+static long think_lmi_async_eventfd(struct think_lmi_file *ctx,
+				    unsigned long arg)
+{
+	struct eventfd_ctx *eventfd = NULL, *old;
+	int fd;
+
+	if (copy_from_user(&fd, (int *)arg, sizeof(fd)))
+		return -EFAULT;
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock(&ctx->lock);
+	old = ctx->eventfd;
+	ctx->eventfd = eventfd;
+	spin_unlock(&ctx->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static size_t think_lmi_completion_size(struct think_lmi_async *req)
+{
+	return ALIGN(sizeof(struct tlmi_completion) + req->out_len, 8);
+}
+
+static int think_lmi_put_completion(struct think_lmi_async *req,
+				    char *buf)
+{
+	struct tlmi_completion rec = {
+		.hdr.type = TLMI_EVENT_COMPLETION,
+		.hdr.size = think_lmi_completion_size(req),
+		.ticket = req->ticket,
+		.op = req->op,
+		.status = req->status,
+		.len = req->out_len,
+	};
+
+	if (copy_to_user(buf, &rec, sizeof(rec)) ||
+	    copy_to_user(buf + sizeof(rec), req->out, req->out_len))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Copy the oldest completion record to buf. Returns its size, 0 if there
+ * is none, or -ENOSPC if it doesn't fit.
+ */
+static ssize_t think_lmi_read_completion(struct think_lmi_file *ctx,
+					 char *buf, size_t count)
+{
+	struct think_lmi_async *req;
+	size_t size;
+	int ret;
+
+	spin_lock(&ctx->lock);
+	req = list_first_entry_or_null(&ctx->done, struct think_lmi_async,
+				       node);
+	if (req && think_lmi_completion_size(req) > count)
+		req = ERR_PTR(-ENOSPC);
+	else if (req) {
+		list_del(&req->node);
+		ctx->async_count--;
+	}
+	spin_unlock(&ctx->lock);
+
+	if (IS_ERR_OR_NULL(req))
+		return PTR_ERR_OR_ZERO(req);
+
+	size = think_lmi_completion_size(req);
+	ret = think_lmi_put_completion(req, buf);
+	think_lmi_async_free(req);
+	return ret ? ret : size;
+}
+
+/*
+ * Copy the next change event this file hasn't seen to buf. Returns its
+ * size, 0 if there is none, or -ENOSPC if it doesn't fit.
+ */
+static ssize_t think_lmi_read_change(struct think_lmi_file *ctx, char *buf,
+				     size_t count)
+{
+	struct think_lmi *think = ctx->think;
+	struct tlmi_change rec = { .hdr.type = TLMI_EVENT_CHANGE };
+	struct think_lmi_change *change;
+	ssize_t ret;
+
+	if (!ctx->watching)
+		return 0;
+
+	mutex_lock(&think->change_lock);
+	if (ctx->seen_gen == think->change_gen) {
+		ret = 0;
+		goto out;
+	}
+
+	change = &think->changes[(ctx->seen_gen + 1) % TLMI_CHANGE_RING];
+	if (change->gen != ctx->seen_gen + 1) {
+		/* Overwritten already, the reader has to start over */
+		rec.generation = think->change_gen;
+		rec.reason = TLMI_CHANGE_LOST;
+		change = NULL;
+	} else {
+		rec.generation = change->gen;
+		rec.reason = change->reason;
+		rec.count = change->count;
+	}
+	rec.hdr.size = ALIGN(struct_size(&rec, index, rec.count), 8);
+
+	if (rec.hdr.size > count) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	if (copy_to_user(buf, &rec, sizeof(rec)) ||
+	    (change && copy_to_user(buf + sizeof(rec), change->index,
+				    change->count * sizeof(change->index[0])))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ctx->seen_gen = rec.generation;
+	ret = rec.hdr.size;
+out:
+	mutex_unlock(&think->change_lock);
+	return ret;
+}
+
+static bool think_lmi_file_readable(struct think_lmi_file *ctx)
+{
+	return !list_empty(&ctx->done) ||
+	       (ctx->watching &&
+		READ_ONCE(ctx->seen_gen) != READ_ONCE(ctx->think->change_gen));
+}
+
+/* Return as many completion and change records as fit in buf */
+static ssize_t think_lmi_chardev_read(struct file *filp, char *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct think_lmi_file *ctx = filp->private_data;
+	ssize_t done = 0;
+	ssize_t ret;
+
+	for (;;) {
+		ret = think_lmi_read_completion(ctx, buf + done, count - done);
+		if (!ret)
+			ret = think_lmi_read_change(ctx, buf + done,
+						    count - done);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+		if (done)
+			return done;
+		if (ret == -ENOSPC)
+			return -EINVAL;
+		if (ret)
+			return ret;
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(ctx->think->event_wait,
+					       think_lmi_file_readable(ctx));
+		if (ret)
+			return ret;
+	}
+}
+
+static __poll_t think_lmi_chardev_poll(struct file *filp, poll_table *wait)
+{
+	struct think_lmi_file *ctx = filp->private_data;
+
+	poll_wait(filp, &ctx->think->event_wait, wait);
+	return think_lmi_file_readable(ctx) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int think_lmi_chardev_fasync(int fd, struct file *filp, int on)
+{
+	struct think_lmi_file *ctx = filp->private_data;
+
+	return fasync_helper(fd, filp, on, &ctx->fasync);
+}
+
+static long think_lmi_watch(struct think_lmi_file *ctx, unsigned long arg)
+{
+	struct think_lmi *think = ctx->think;
+
+	if (arg > 1)
+		return -EINVAL;
+
+	/* Only changes from now on are reported */
+	mutex_lock(&think->change_lock);
+	ctx->seen_gen = think->change_gen;
+	ctx->watching = arg;
+	if (arg && list_empty(&ctx->watch_node))
+		list_add_tail(&ctx->watch_node, &think->watchers);
+	else if (!arg)
+		list_del_init(&ctx->watch_node);
+	mutex_unlock(&think->change_lock);
+	return 0;
+}
+
+/* Character device open interface */
+static int think_lmi_chardev_open(struct inode *inode, struct file *file)
+{
+	struct think_lmi_file *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->think = container_of(inode->i_cdev, struct think_lmi, c_dev);
+	kref_init(&ctx->ref);
+	INIT_WORK(&ctx->work, think_lmi_file_work);
+	spin_lock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->pending);
+	INIT_LIST_HEAD(&ctx->watch_node);
+	INIT_LIST_HEAD(&ctx->done);
+	file->private_data = ctx;
+        return THINK_LMI_SUCCESS;
+}
+
+/* Character device ioctl interface */
+static long think_lmi_ioctl(struct file *filp, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct think_lmi_file *ctx = filp->private_data;
+	struct think_lmi *think = ctx->think;
+	int ret;
+	unsigned char settings_str[TLMI_SETTINGS_MAXLEN];
+	char get_set_string[TLMI_GETSET_MAXLEN];
+	char newpassword[TLMI_PWD_MAXLEN];
+	struct think_lmi_setting *setting;
+	struct tlmi_buf req, *v2 = NULL;
+	unsigned int v1_cmd;
+	__u32 index;
+	char *value;
+	char *tmp_string = NULL;
+	ssize_t count =0;
+
+	/*
+	 * v2 requests pass the input length explicitly and otherwise work
+	 * like the v1 command they map to. v1 requests always pass a fixed
+	 * size buffer.
+	 */
+	v1_cmd = think_lmi_v2_to_v1(cmd);
+	if (v1_cmd) {
+		if (copy_from_user(&req, (void *)arg, sizeof(req)))
+			return -EFAULT;
+		if (req.in_len >= sizeof(get_set_string))
+			return -EINVAL;
+		if (copy_from_user(get_set_string, u64_to_user_ptr(req.in),
+				   req.in_len))
+			return -EFAULT;
+		get_set_string[req.in_len] = '\0';
+		v2 = &req;
+		cmd = v1_cmd;
+	} else if (think_lmi_v1_in_size(cmd)) {
+		if (copy_from_user(get_set_string, (void *)arg,
+				   think_lmi_v1_in_size(cmd)))
+			return -EFAULT;
+		get_set_string[think_lmi_v1_in_size(cmd) - 1] = '\0';
+	}
+
+	switch (cmd) {
+	case THINKLMI_GET_SETTINGS:
+	case THINKLMI_GET_SETTINGS_STRING:
+	case THINKLMI_SET_SETTING:
+	case THINKLMI_SHOW_SETTING:
+	case THINKLMI_REFRESH_SETTING:
+	case THINKLMI_BATCH_SET:
+	case THINKLMI_GET_VEC:
+	case THINKLMI_ASYNC_SUBMIT:
+		ret = think_lmi_wait_settings(think, filp);
+		if (ret)
+			return ret;
+		break;
+	}
+
+	switch(cmd){
+	case THINKLMI_GET_SETTINGS:
+		if (copy_to_user((int *)arg, &think->settings_count,
+				 sizeof(think->settings_count)))
+			return -EFAULT;
+		break;
+	case THINKLMI_GET_SETTINGS_STRING:
+		/* Get the string for given index */
+		if (v2) {
+			/* v2 passes a __u32 index, so it isn't limited to 255 */
+			if (req.in_len != sizeof(index))
+				return -EINVAL;
+			memcpy(&index, get_set_string, sizeof(index));
+		} else {
+			index = (unsigned char)get_set_string[0];
+		}
+		if ((index >= think->settings_size) ||
+		    (!think->settings[index].name))
+			return -EINVAL;
+		if (v2)
+			return think_lmi_copy_out(v2, arg,
+					think->settings[index].name,
+					strlen(think->settings[index].name) + 1);
+		strncpy(settings_str, think->settings[index].name,
+				(TLMI_SETTINGS_MAXLEN-1));
+		settings_str[TLMI_SETTINGS_MAXLEN - 1] = '\0';
+		if (copy_to_user((char *)arg, settings_str,
+				 sizeof(settings_str)))
+			return -EFAULT;
+		break;
+	case THINKLMI_SET_SETTING:
+		ret = think_lmi_apply_setting(think, ctx->auth_string,
+					      get_set_string, &setting);
+		if (ret == -EINVAL && setting) {
+			/*
+			 * The value was refused, return the valid choices,
+			 * or the size they need with -ENOSPC
+			 */
+			ret = think_lmi_copy_choices(think, setting, v2, arg,
+						     settings_str,
+						     sizeof(settings_str));
+			return ret ? ret : -EINVAL;
+		}
+		if (ret)
+			goto error;
+		break;
+	case THINKLMI_SHOW_SETTING:
+	case THINKLMI_REFRESH_SETTING:
+		setting = think_lmi_find_setting(think, get_set_string,
+						 strlen(get_set_string));
+		if (!setting) /* Invalid entry */
+			return -EINVAL;
+
+		if (v2)
+			return think_lmi_show_setting_v2(think, setting,
+					cmd == THINKLMI_REFRESH_SETTING,
+					v2, arg);
+
+		count = think_lmi_show_setting(think, setting,
+					       cmd == THINKLMI_REFRESH_SETTING,
+					       settings_str,
+					       sizeof(settings_str));
+		if (count < 0)
+			return count;
+
+		if (count > sizeof(settings_str)) {
+			/* Unlikely to happen - but if the string is going
+			 * to overflow the amount of space that is
 			 * available then we need to truncate.
 			 * Issue a warning so we know about these
 			 */
-			count = TLMI_SETTINGS_MAXLEN;
+			count = sizeof(settings_str);
 			pr_warn("WARNING: Result truncated to fit string buffer\n");
 		}
-		tmp_string[count-1] = '\0';
-		if (copy_to_user((char *)arg, tmp_string, count)) {
-			kfree(tmp_string);
-			goto error;
-		}
-		kfree(tmp_string);
+		ret = think_lmi_copy_out(v2, arg, settings_str, count);
+		if (ret)
+			return ret;
 		break;
         case THINKLMI_AUTHENTICATE:
-		if (copy_from_user(get_set_string, (void *)arg,
-				   sizeof(get_set_string)))
-			return -EFAULT;
 		tmp_string = get_set_string;
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password, TLMI_PWD_MAXLEN, "%s", value);
+		snprintf(ctx->password, TLMI_PWD_MAXLEN, "%s", value);
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password_encoding, TLMI_ENC_MAXLEN,
+		snprintf(ctx->password_encoding, TLMI_ENC_MAXLEN,
 			                     "%s", value);
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password_kbdlang, TLMI_LANG_MAXLEN,
+		snprintf(ctx->password_kbdlang, TLMI_LANG_MAXLEN,
 			                      "%s", value);
 
-		update_auth_string(think);
+		update_auth_string(ctx);
 		break;
 
 	case THINKLMI_CHANGE_PASSWORD:
-		if (copy_from_user(get_set_string, (void *)arg,
-				   sizeof(get_set_string)))
-			return -EFAULT;
 		snprintf(settings_str, TLMI_SETTINGS_MAXLEN, "%s",
 				             get_set_string);
 		tmp_string = get_set_string;
@@ -644,12 +2593,12 @@ static long think_lmi_chardev_ioctl(struct file *filp, unsigned int cmd,
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password_type, TLMI_PWDTYPE_MAXLEN,
+		snprintf(ctx->password_type, TLMI_PWDTYPE_MAXLEN,
 			                   "%s",value);
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password, TLMI_PWD_MAXLEN, "%s", value);
+		snprintf(ctx->password, TLMI_PWD_MAXLEN, "%s", value);
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
@@ -657,110 +2606,67 @@ static long think_lmi_chardev_ioctl(struct file *filp, unsigned int cmd,
 		value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password_encoding, TLMI_ENC_MAXLEN,
+		snprintf(ctx->password_encoding, TLMI_ENC_MAXLEN,
 			                    "%s",value);
                 value = strsep(&tmp_string, ",");
 		if (!value)
 			return -EFAULT;
-		snprintf(think->password_kbdlang, TLMI_LANG_MAXLEN,
+		snprintf(ctx->password_kbdlang, TLMI_LANG_MAXLEN,
 			                     "%s",value);
 
-		update_auth_string(think);
+		update_auth_string(ctx);
 
 	        ret = think_lmi_set_bios_password(settings_str);
+		if (!ret)
+			think_lmi_notify_change(think, TLMI_CHANGE_PASSWORD,
+						NULL, 0);
 		break;
 
-	case THINKLMI_DEBUG:
-		if (copy_from_user(get_set_string, (void *)arg,
-				            sizeof(get_set_string)))
-			return -EFAULT;
-		snprintf(settings_str, TLMI_SETTINGS_MAXLEN, "%s",
-				            get_set_string);
-		ret = think_lmi_set_platform_settings(settings_str);
-                if (ret) {
-			goto error;
-                }
-		break;
-
-	case THINKLMI_LMIOPCODE:
-		if (copy_from_user(get_set_string, (void *)arg, sizeof(get_set_string)))
-			return -EFAULT;
-		snprintf(settings_str, TLMI_SETTINGS_MAXLEN, "%s", get_set_string);
-
-		tmp_string = get_set_string;
-
-		value = strsep(&tmp_string, ",");
-		if (!value)
-			return -EFAULT;
-
-		snprintf(think->password, TLMI_PWD_MAXLEN, "%s", get_set_string);
-		sprintf(settings_str, "WmiOpcodePasswordAdmin:%s;", think->password);
-
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
-		if (ret)
-			goto error;
-
-		value = strsep(&tmp_string, ",");
-		if (!value)
-			return -EFAULT;
-
-		snprintf(think->password_type, TLMI_PWDTYPE_MAXLEN, "%s", value);
-		sprintf(settings_str, "WmiOpcodePasswordType:%s;", think->password_type);
-
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
-		if (ret)
-			goto error;
-
-		value = strsep(&tmp_string, ",");
-		if (!value)
-			return -EFAULT;
-
-		snprintf(think->passcurr, TLMI_PWD_MAXLEN, "%s", value);
-		sprintf(settings_str, "WmiOpcodePasswordCurrent01:%s;", think->passcurr);
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
-		if (ret)
-			goto error;
-
-		value = strsep(&tmp_string, ",");
-		if (!value)
-			return -EFAULT;
-
-		snprintf(think->passnew, TLMI_PWD_MAXLEN, "%s", value);
-		sprintf(settings_str, "WmiOpcodePasswordNew01:%s", think->passnew);
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
-		if (ret)
+	case THINKLMI_DEBUG:
+		snprintf(settings_str, TLMI_SETTINGS_MAXLEN, "%s",
+				            get_set_string);
+		ret = think_lmi_set_platform_settings(settings_str);
+		think_lmi_invalidate_values(think, NULL);
+                if (ret) {
 			goto error;
+                }
+		think_lmi_notify_change(think, TLMI_CHANGE_SET, NULL, 0);
+		break;
 
-		sprintf(settings_str, "WmiOpcodePasswordSetUpdate;");
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
+	case THINKLMI_LMIOPCODE:
+		ret = think_lmi_opcode_password(ctx, get_set_string);
 		if (ret)
 			goto error;
-
 		break;
 	case THINKLMI_TPMTYPE:
-		if (copy_from_user(get_set_string, (void *)arg,
-					sizeof(get_set_string)))
-			return -EFAULT;
-
-		sprintf(settings_str, "WmiOpcodeTPM:");
-		strncat(settings_str, get_set_string, TLMI_SETTINGS_MAXLEN);
-		ret = think_lmi_set_lmiopcode_settings(settings_str);
-		if (ret)
-			return -EFAULT;
-		ret = think_lmi_save_bios_settings(think->auth_string);
-		if (ret)
+		if (think_lmi_opcode_tpm(ctx, get_set_string))
 			return -EFAULT;
-
 		break;
+	case THINKLMI_OPCODE_SEQ:
+		return think_lmi_opcode_seq(think, ctx->auth_string, arg);
+	case THINKLMI_BATCH_SET:
+		return think_lmi_batch_set(think, ctx->auth_string, arg);
+	case THINKLMI_GET_VEC:
+		return think_lmi_get_vec(think, arg);
+	case THINKLMI_ASYNC_SUBMIT:
+		return think_lmi_async_submit(ctx, arg);
+	case THINKLMI_ASYNC_EVENTFD:
+		return think_lmi_async_eventfd(ctx, arg);
+	case THINKLMI_WATCH:
+		return think_lmi_watch(ctx, arg);
 	case THINKLMI_LOAD_DEFAULT:
-		ret = think_lmi_load_default(think->auth_string);
+		ret = think_lmi_load_default(ctx->auth_string);
+		think_lmi_invalidate_values(think, NULL);
 		if (ret)
 			return -EFAULT;
+		think_lmi_notify_change(think, TLMI_CHANGE_LOAD_DEFAULT,
+					NULL, 0);
 		break;
 	case THINKLMI_SAVE_SETTINGS:
-		ret = think_lmi_save_bios_settings(think->auth_string);
+		ret = think_lmi_save_bios_settings(ctx->auth_string);
 		if (ret)
 			return -EFAULT;
+		think_lmi_notify_change(think, TLMI_CHANGE_SAVE, NULL, 0);
 		break;
 	default:
 		return -EINVAL;
@@ -769,19 +2675,71 @@ static long think_lmi_chardev_ioctl(struct file *filp, unsigned int cmd,
 	return THINK_LMI_SUCCESS;
 
 error:
-	kfree(settings);
-	kfree(choices);
 	return ret ? ret : count;
 }
 
+/* Commands that change BIOS or authentication state */
+static bool think_lmi_cmd_mutates(unsigned int cmd)
+{
+	unsigned int v1_cmd = think_lmi_v2_to_v1(cmd);
+
+	switch (v1_cmd ? v1_cmd : cmd) {
+	case THINKLMI_SET_SETTING:
+	case THINKLMI_BATCH_SET:
+	case THINKLMI_AUTHENTICATE:
+	case THINKLMI_CHANGE_PASSWORD:
+	case THINKLMI_DEBUG:
+	case THINKLMI_LMIOPCODE:
+	case THINKLMI_TPMTYPE:
+	case THINKLMI_OPCODE_SEQ:
+	case THINKLMI_LOAD_DEFAULT:
+	case THINKLMI_SAVE_SETTINGS:
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Reads are served from the cache in parallel. Anything that changes
+ * state runs its whole sequence of WMI calls under wmi_lock, so a set
+ * and its save or discard are never interleaved with another writer.
+ */
+static long think_lmi_chardev_ioctl(struct file *filp, unsigned int cmd,
+				    unsigned long arg)
+{
+	struct think_lmi_file *ctx = filp->private_data;
+	struct think_lmi *think = ctx->think;
+	long ret;
+
+	if (!think_lmi_cmd_mutates(cmd))
+		return think_lmi_ioctl(filp, cmd, arg);
+
+	if (mutex_lock_interruptible(&think->wmi_lock))
+		return -ERESTARTSYS;
+	ret = think_lmi_ioctl(filp, cmd, arg);
+	mutex_unlock(&think->wmi_lock);
+	return ret;
+}
+
 static int think_lmi_chardev_release(struct inode *inode,
 	                    struct file *file)
 {
+	struct think_lmi_file *ctx = file->private_data;
+
+	mutex_lock(&ctx->think->change_lock);
+	list_del_init(&ctx->watch_node);
+	mutex_unlock(&ctx->think->change_lock);
+
+	/* Requests still running keep the context until they finish */
+	kref_put(&ctx->ref, think_lmi_file_free);
 	return THINK_LMI_SUCCESS;
 }
 
 static const struct file_operations think_lmi_chardev_fops = {
 	.open           = think_lmi_chardev_open,
+	.read           = think_lmi_chardev_read,
+	.poll           = think_lmi_chardev_poll,
+	.fasync         = think_lmi_chardev_fasync,
 	.unlocked_ioctl = think_lmi_chardev_ioctl,
 	.release        = think_lmi_chardev_release,
 };
@@ -831,46 +2789,691 @@ static void think_lmi_chardev_exit(struct think_lmi *think)
 	unregister_chrdev_region(tlmi_dev, TLMI_NUM_DEVICES);
 }
 
+/*
+ * Number of Lenovo_BiosSetting instances reported by the WMI core, or a
+ * negative value if this kernel cannot tell us.
+ */
+static int think_lmi_instance_count(struct think_lmi *think)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0))
+	return wmidev_instance_count(think->wmi_device);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* Make room for at least 'size' slots in the settings table */
+static int think_lmi_grow_settings(struct think_lmi *think, int size)
+{
+	struct think_lmi_setting *settings;
+
+	if (size <= think->settings_size)
+		return 0;
+
+	settings = krealloc(think->settings, size * sizeof(*settings),
+			    GFP_KERNEL);
+	if (!settings)
+		return -ENOMEM;
+
+	memset(settings + think->settings_size, 0,
+	       (size - think->settings_size) * sizeof(*settings));
+	think->settings = settings;
+	think->settings_size = size;
+	return 0;
+}
+
+/* Append len bytes of str to the names arena and return their offset */
+static int think_lmi_add_name(struct think_lmi *think, const char *str,
+			      size_t len)
+{
+	size_t off = think->names_len;
+	size_t size = think->names_size;
+	char *names;
+
+	if (off + len + 1 > size) {
+		size = max3(size * 2, off + len + 1, (size_t)TLMI_NAMES_CHUNK);
+		names = krealloc(think->names, size, GFP_KERNEL);
+		if (!names)
+			return -ENOMEM;
+		think->names = names;
+		think->names_size = size;
+	}
+
+	memcpy(think->names + off, str, len);
+	think->names[off + len] = '\0';
+	think->names_len += len + 1;
+	return off;
+}
+
 static void think_lmi_analyze(struct think_lmi *think)
 {
-	acpi_status status;
+	int count, limit;
 	int i = 0;
 
+	/* Reserve offset 0 for empty slots */
+	if (think_lmi_add_name(think, "", 0) < 0)
+		return;
+
 	/*
-	 * Try to find the number of valid settings of this machine
-	 * and use it to create sysfs attributes
+	 * Ask the WMI core how many settings this machine has. Older kernels
+	 * can't tell, so probe instances until the BIOS rejects one.
 	 */
-	for (i = 0; i < TLMI_MAX_SETTINGS; ++i) {
+	count = think_lmi_instance_count(think);
+	limit = count >= 0 ? count : TLMI_MAX_INSTANCES;
+
+	for (i = 0; i < limit; ++i) {
+		struct think_lmi_setting *setting;
 		char *item = NULL;
-		int spleng = 0;
-		int num = 0;
-		char *p;
+		size_t len;
+		int off;
 
-		status = think_lmi_setting(i, &item,
-			        LENOVO_BIOS_SETTING_GUID);
-		if (ACPI_FAILURE(status))
+		if (think_lmi_setting(i, &item, LENOVO_BIOS_SETTING_GUID)) {
+			if (count < 0)
+				break;
+			continue;
+		}
+		if (!*item) {
+			kvfree(item);
+			continue;
+		}
+
+		if (i >= think->settings_size &&
+		    think_lmi_grow_settings(think, count >= 0 ? count :
+				min(i + TLMI_SETTINGS_CHUNK, limit))) {
+			kvfree(item);
 			break;
-		if (!item )
+		}
+
+		/* Keep only the name, not the value part */
+		len = strchrnul(item, ',') - item;
+		setting = &think->settings[i];
+		off = think_lmi_add_name(think, item, len);
+		if (off < 0) {
+			kvfree(item);
 			break;
-		if (!*item)
-			continue;
+		}
+		setting->wmi_name_off = off;
+		setting->name_off = off;
 
 		/* It is not allowed to have '/' for file name.
 		 * Convert it into '\'. */
-		spleng = strlen(item);
-		for (num = 0; num < spleng; num++) {
-			if (item[num] == '/')
-				item[num] = '\\';
+		if (memchr(item, '/', len)) {
+			off = think_lmi_add_name(think, item, len);
+			if (off < 0) {
+				setting->wmi_name_off = 0;
+				kvfree(item);
+				break;
+			}
+			strreplace(think->names + off, '/', '\\');
+			setting->name_off = off;
 		}
+		kvfree(item);
+		setting->index = i;
+		think->settings_count++;
+	}
+
+}
+
+/*
+ * Point at the names and index them once the arena and table have
+ * stopped moving, so lookups don't have to scan every slot.
+ */
+static void think_lmi_index_settings(struct think_lmi *think)
+{
+	int i;
+
+	for (i = 0; i < think->settings_size; ++i) {
+		struct think_lmi_setting *setting = &think->settings[i];
+
+		if (!setting->wmi_name_off)
+			continue;
+		setting->name = think->names + setting->name_off;
+		setting->wmi_name = think->names + setting->wmi_name_off;
+		setting->hash = full_name_hash(NULL, setting->name,
+					       strlen(setting->name));
+		hash_add(think->setting_hash, &setting->hnode, setting->hash);
+	}
+}
+
+/*
+ * Build the settings table from a snapshot. It is only used if it was
+ * taken on the same BIOS version, is intact and has as many slots as the
+ * BIOS has instances, when the kernel can tell.
+ */
+static int think_lmi_load_snapshot(struct think_lmi *think)
+{
+	const struct think_lmi_snapshot_slot *slot;
+	const struct think_lmi_snapshot *snap;
+	const struct firmware *fw;
+	const char *version, *names;
+	u32 slots, names_len, i;
+	int count, ret;
+
+	version = dmi_get_system_info(DMI_BIOS_VERSION);
+	if (!use_snapshot || !version)
+		return -ENOENT;
+
+	ret = request_firmware_direct(&fw, TLMI_SNAPSHOT_FW,
+				      &think->wmi_device->dev);
+	if (ret)
+		return ret;
+
+	ret = -EINVAL;
+	snap = (const struct think_lmi_snapshot *)fw->data;
+	if (fw->size < sizeof(*snap) ||
+	    le32_to_cpu(snap->magic) != TLMI_SNAPSHOT_MAGIC ||
+	    le32_to_cpu(snap->version) != TLMI_SNAPSHOT_VERSION)
+		goto out;
+	if (strncmp(snap->bios_version, version, sizeof(snap->bios_version))) {
+		pr_info("snapshot is for another BIOS version, scanning\n");
+		goto out;
+	}
+
+	slots = le32_to_cpu(snap->slots);
+	names_len = le32_to_cpu(snap->names_len);
+	if (slots > TLMI_MAX_INSTANCES || !names_len ||
+	    fw->size != sizeof(*snap) + slots * sizeof(*slot) + names_len ||
+	    le32_to_cpu(snap->checksum) !=
+	    crc32_le(~0, fw->data + sizeof(*snap), fw->size - sizeof(*snap)))
+		goto out;
+
+	count = think_lmi_instance_count(think);
+	if (count >= 0 && count != slots)
+		goto out;
+
+	slot = (const struct think_lmi_snapshot_slot *)(snap + 1);
+	names = (const char *)(slot + slots);
+	/* Every offset must land inside a NUL terminated arena */
+	if (names[0] || names[names_len - 1])
+		goto out;
+	for (i = 0; i < slots; i++) {
+		if (le32_to_cpu(slot[i].name_off) >= names_len ||
+		    le32_to_cpu(slot[i].wmi_name_off) >= names_len)
+			goto out;
+	}
+
+	ret = think_lmi_grow_settings(think, slots);
+	if (ret)
+		goto out;
+	think->names = kmemdup(names, names_len, GFP_KERNEL);
+	if (!think->names) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	think->names_len = names_len;
+	think->names_size = names_len;
+
+	for (i = 0; i < slots; i++) {
+		struct think_lmi_setting *setting = &think->settings[i];
 
-		/* Remove the value part */
-		p = strchr(item, ',');
-		if (p)
-			*p = '\0';
-		think->settings[i] = item; /* Cache setting name */
+		setting->name_off = le32_to_cpu(slot[i].name_off);
+		setting->wmi_name_off = le32_to_cpu(slot[i].wmi_name_off);
+		if (!setting->wmi_name_off)
+			continue;
+		setting->index = i;
 		think->settings_count++;
 	}
+	ret = 0;
+out:
+	if (ret == -EINVAL)
+		pr_warn("ignoring invalid %s\n", TLMI_SNAPSHOT_FW);
+	release_firmware(fw);
+	return ret;
+}
+
+/* Serialise the settings table for the snapshot file in debugfs */
+static void *think_lmi_build_snapshot(struct think_lmi *think, size_t *size)
+{
+	struct think_lmi_snapshot_slot *slot;
+	struct think_lmi_snapshot *snap;
+	const char *version;
+	int i;
+
+	version = dmi_get_system_info(DMI_BIOS_VERSION);
+	if (!version || !think->names)
+		return ERR_PTR(-ENODATA);
+
+	*size = sizeof(*snap) + think->settings_size * sizeof(*slot) +
+		think->names_len;
+	snap = kvzalloc(*size, GFP_KERNEL);
+	if (!snap)
+		return ERR_PTR(-ENOMEM);
+
+	snap->magic = cpu_to_le32(TLMI_SNAPSHOT_MAGIC);
+	snap->version = cpu_to_le32(TLMI_SNAPSHOT_VERSION);
+	strscpy(snap->bios_version, version, sizeof(snap->bios_version));
+	snap->slots = cpu_to_le32(think->settings_size);
+	snap->names_len = cpu_to_le32(think->names_len);
+
+	slot = (struct think_lmi_snapshot_slot *)(snap + 1);
+	for (i = 0; i < think->settings_size; i++) {
+		slot[i].name_off = cpu_to_le32(think->settings[i].name_off);
+		slot[i].wmi_name_off =
+			cpu_to_le32(think->settings[i].wmi_name_off);
+	}
+	memcpy(slot + think->settings_size, think->names, think->names_len);
+
+	snap->checksum = cpu_to_le32(crc32_le(~0, (u8 *)(snap + 1),
+					      *size - sizeof(*snap)));
+	return snap;
+}
+
+/*
+ * Whether instance i of the BIOS is the setting the table has there. An
+ * empty or missing instance matches a slot with no setting.
+ */
+static bool think_lmi_slot_matches(struct think_lmi *think, int i)
+{
+	u32 off = i < think->settings_size ?
+		  think->settings[i].wmi_name_off : 0;
+	char *item = NULL;
+	bool match;
+
+	if (think_lmi_setting(i, &item, LENOVO_BIOS_SETTING_GUID))
+		return !off;
+	match = off ? think_lmi_item_is(item, think->names + off) : !*item;
+	kvfree(item);
+	return match;
+}
+
+/*
+ * Check a loaded snapshot against the BIOS before it is used. The
+ * instance count was compared when it was loaded, if the kernel reports
+ * it; otherwise the instance after the last setting must not be another
+ * one. Then the first and last settings must be where the snapshot says.
+ * That is two or three queries whatever the number of settings. Other
+ * values are checked as they are read.
+ */
+static int think_lmi_check_snapshot(struct think_lmi *think)
+{
+	int i, first = -1, last = -1;
+
+	for (i = 0; i < think->settings_size; i++) {
+		if (!think->settings[i].wmi_name_off)
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+	}
+	if (first < 0)
+		return -EINVAL;
+
+	if (think_lmi_instance_count(think) < 0 &&
+	    !think_lmi_slot_matches(think, last + 1))
+		return -EINVAL;
+	if (!think_lmi_slot_matches(think, first) ||
+	    (last != first && !think_lmi_slot_matches(think, last)))
+		return -EINVAL;
+	return 0;
+}
+
+/* Forget a settings table that was loaded but not published */
+static void think_lmi_drop_settings(struct think_lmi *think)
+{
+	kfree(think->settings);
+	think->settings = NULL;
+	think->settings_size = 0;
+	think->settings_count = 0;
+	kfree(think->names);
+	think->names = NULL;
+	think->names_len = 0;
+	think->names_size = 0;
+}
+
+static void think_lmi_analyze_work(struct work_struct *work)
+{
+	struct think_lmi *think = container_of(work, struct think_lmi,
+					       analyze_work);
+	ktime_t start = ktime_get();
+
+	think->from_snapshot = !think_lmi_load_snapshot(think);
+	if (think->from_snapshot && think_lmi_check_snapshot(think)) {
+		pr_warn("settings snapshot doesn't match the BIOS, scanning\n");
+		think_lmi_drop_settings(think);
+		think->from_snapshot = false;
+	}
+	if (!think->from_snapshot)
+		think_lmi_analyze(think);
+	think_lmi_index_settings(think);
+
+	think->analyze_us = ktime_us_delta(ktime_get(), start);
+	pr_info("enumerated %d settings in %llu us%s\n",
+		think->settings_count, think->analyze_us,
+		think->from_snapshot ? " from snapshot" : "");
+	complete_all(&think->analyze_done);
+}
+
+/*
+ * After a resume, read the settings that were cached before it again so
+ * the ones in use are served from the cache soon. Reading them also checks
+ * their names, which notices a BIOS updated while hibernated. Settings
+ * nobody read are left for the first access.
+ */
+static void think_lmi_resume_work(struct work_struct *work)
+{
+	struct think_lmi *think = container_of(work, struct think_lmi,
+					       resume_work);
+	struct think_lmi_setting *setting;
+	int i, bad = 0;
+
+	if (!completion_done(&think->analyze_done))
+		return;
+
+	think_lmi_check_resume(think);
+	for (i = 0; i < think->settings_size; i++) {
+		setting = &think->settings[i];
+		if (READ_ONCE(think->unloading))
+			return;
+		if (!READ_ONCE(setting->rewarm))
+			continue;
+		WRITE_ONCE(setting->rewarm, false);
+		if (think_lmi_fill_cache(think, setting, false) == -EIO)
+			bad++;
+	}
+	if (bad)
+		pr_warn("%d settings failed to read after resume\n", bad);
+}
+
+/*
+ * Don't touch the BIOS on the resume path. Mark the cache stale and leave
+ * reading it again to the first access or the resume work.
+ */
+static int __maybe_unused think_lmi_resume(struct device *dev)
+{
+	struct think_lmi *think = dev_get_drvdata(dev);
+
+	atomic_inc(&think->resume_epoch);
+	queue_work(system_long_wq, &think->resume_work);
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(think_lmi_pm_ops, NULL, think_lmi_resume);
+
+static void think_lmi_detect_quirks(void)
+{
+	const struct dmi_system_id *id;
+
+	id = dmi_first_match(think_lmi_quirk_table);
+	if (id)
+		think_lmi_quirks = (unsigned long)id->driver_data;
+
+	if (duplicate_call == 0)
+		think_lmi_quirks &= ~TLMI_QUIRK_DUPLICATE_CALL;
+	else if (duplicate_call > 0)
+		think_lmi_quirks |= TLMI_QUIRK_DUPLICATE_CALL;
+
+	if (!(think_lmi_quirks & TLMI_QUIRK_DUPLICATE_CALL))
+		pr_info("duplicate WMI method evaluation disabled\n");
+}
+
+/* Skip empty slots in the settings table */
+static struct think_lmi_setting *think_lmi_seq_setting(struct think_lmi *think,
+						       loff_t *pos)
+{
+	for (; *pos < think->settings_size; ++*pos) {
+		if (think->settings[*pos].name)
+			return &think->settings[*pos];
+	}
+	return NULL;
+}
+
+static void *think_lmi_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct think_lmi *think = m->private;
+
+	if (wait_for_completion_interruptible(&think->analyze_done))
+		return ERR_PTR(-ERESTARTSYS);
+
+	return think_lmi_seq_setting(think, pos);
+}
+
+static void *think_lmi_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return think_lmi_seq_setting(m->private, pos);
+}
+
+static void think_lmi_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+/* One "name,value,choices" line per setting */
+static int think_lmi_seq_show(struct seq_file *m, void *v)
+{
+	struct think_lmi *think = m->private;
+	struct think_lmi_setting *setting = v;
+	const char *value, *choices;
+
+	seq_printf(m, "%s,", setting->name);
+	if (!think_lmi_lock_strings(think, setting, false, &value, &choices)) {
+		/* Without choices the value is the whole "Item,Value" */
+		if (!choices && strchr(value, ','))
+			value = strchr(value, ',') + 1;
+		seq_puts(m, value);
+		if (choices)
+			seq_printf(m, ",%s", choices);
+		up_read(&think->cache_sem);
+	}
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations think_lmi_seq_ops = {
+	.start = think_lmi_seq_start,
+	.next  = think_lmi_seq_next,
+	.stop  = think_lmi_seq_stop,
+	.show  = think_lmi_seq_show,
+};
+
+static int think_lmi_settings_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	ret = seq_open(file, &think_lmi_seq_ops);
+	if (!ret)
+		((struct seq_file *)file->private_data)->private =
+			inode->i_private;
+	return ret;
+}
+
+static const struct file_operations think_lmi_settings_fops = {
+	.owner   = THIS_MODULE,
+	.open    = think_lmi_settings_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+struct think_lmi_snapshot_buf {
+	void *data;
+	size_t size;
+};
+
+static int think_lmi_snapshot_open(struct inode *inode, struct file *file)
+{
+	struct think_lmi *think = inode->i_private;
+	struct think_lmi_snapshot_buf *buf;
+
+	if (wait_for_completion_interruptible(&think->analyze_done))
+		return -ERESTARTSYS;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	buf->data = think_lmi_build_snapshot(think, &buf->size);
+	if (IS_ERR(buf->data)) {
+		int ret = PTR_ERR(buf->data);
+
+		kfree(buf);
+		return ret;
+	}
+	file->private_data = buf;
+	return 0;
+}
+
+static ssize_t think_lmi_snapshot_read(struct file *file, char *ubuf,
+				       size_t count, loff_t *ppos)
+{
+	struct think_lmi_snapshot_buf *buf = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf->data,
+				       buf->size);
+}
+
+static int think_lmi_snapshot_release(struct inode *inode, struct file *file)
+{
+	struct think_lmi_snapshot_buf *buf = file->private_data;
+
+	kvfree(buf->data);
+	kfree(buf);
+	return 0;
+}
+
+static const struct file_operations think_lmi_snapshot_fops = {
+	.owner   = THIS_MODULE,
+	.open    = think_lmi_snapshot_open,
+	.read    = think_lmi_snapshot_read,
+	.llseek  = default_llseek,
+	.release = think_lmi_snapshot_release,
+};
+
+static int think_lmi_stats_show(struct seq_file *m, void *v)
+{
+	struct think_lmi_wmi_stats *stats = m->private;
+	long count;
+	int i;
+
+	seq_printf(m, "guid: %s\n", stats->guid);
+	seq_printf(m, "calls: %ld\n", atomic_long_read(&stats->calls));
+	seq_printf(m, "total_us: %lld\n",
+		   (long long)atomic64_read(&stats->total_us));
+	for (i = 0; i < TLMI_RESULT_COUNT; i++)
+		seq_printf(m, "%s: %ld\n", think_lmi_result_names[i],
+			   atomic_long_read(&stats->results[i]));
+
+	seq_puts(m, "latency_us:\n");
+	for (i = 0; i < TLMI_LATENCY_BUCKETS; i++) {
+		count = atomic_long_read(&stats->latency[i]);
+		if (!count)
+			continue;
+		if (!i)
+			seq_printf(m, "  0: %ld\n", count);
+		else if (i == TLMI_LATENCY_BUCKETS - 1)
+			seq_printf(m, "  %llu+: %ld\n", 1ULL << (i - 1), count);
+		else
+			seq_printf(m, "  %llu-%llu: %ld\n", 1ULL << (i - 1),
+				   (1ULL << i) - 1, count);
+	}
+	return 0;
+}
+
+static int think_lmi_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, think_lmi_stats_show, inode->i_private);
+}
+
+static const struct file_operations think_lmi_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = think_lmi_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * A header, then one line per call, oldest first, with tab separated
+ * fields: start_us us calls class instance status input output.
+ */
+static int think_lmi_capture_show(struct seq_file *m, void *v)
+{
+	const char *version = dmi_get_system_info(DMI_BIOS_VERSION);
+	const struct think_lmi_capture_entry *entry;
+	unsigned long i, first, len;
+
+	seq_puts(m, "# think-lmi capture 1\n");
+	seq_printf(m, "# bios_version: %s\n", version ? version : "");
+
+	mutex_lock(&think_lmi_capture_lock);
+	len = min_t(unsigned long, think_lmi_capture_count,
+		    think_lmi_capture_size);
+	first = think_lmi_capture_count - len;
+	for (i = first; i < think_lmi_capture_count; i++) {
+		entry = &think_lmi_capture_ring[i % think_lmi_capture_size];
+		seq_printf(m, "%llu\t%llu\t%d\t%s\t%d\t%u\t",
+			   entry->start_us, entry->us, entry->calls,
+			   think_lmi_guid_name(entry->guid), entry->instance,
+			   entry->status);
+		if (entry->input)
+			seq_escape(m, entry->input, "\t\n\\");
+		seq_putc(m, '\t');
+		if (entry->output)
+			seq_escape(m, entry->output, "\t\n\\");
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&think_lmi_capture_lock);
+	return 0;
+}
+
+static int think_lmi_capture_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, think_lmi_capture_show, NULL);
+}
+
+/* Writing N starts capturing the last N calls, 0 stops */
+static ssize_t think_lmi_capture_write(struct file *file, const char *ubuf,
+				       size_t count, loff_t *ppos)
+{
+	unsigned int size;
+	int ret;
+
+	ret = kstrtouint_from_user(ubuf, count, 0, &size);
+	if (ret)
+		return ret;
+	ret = think_lmi_capture_set(size);
+	return ret ? ret : count;
+}
+
+static const struct file_operations think_lmi_capture_fops = {
+	.owner   = THIS_MODULE,
+	.open    = think_lmi_capture_open,
+	.read    = seq_read,
+	.write   = think_lmi_capture_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
 
+static void think_lmi_debugfs_init(struct think_lmi *think)
+{
+	struct dentry *stats_dir;
+	int i;
+
+	think->debugfs_dir = debugfs_create_dir(THINK_LMI_FILE, NULL);
+	debugfs_create_ulong("quirks", 0444, think->debugfs_dir,
+			     &think_lmi_quirks);
+	debugfs_create_atomic_t("duplicate_calls_skipped", 0444,
+				think->debugfs_dir, &think_lmi_skipped_calls);
+	debugfs_create_file("settings", 0400, think->debugfs_dir, think,
+			    &think_lmi_settings_fops);
+	debugfs_create_file("snapshot", 0400, think->debugfs_dir, think,
+			    &think_lmi_snapshot_fops);
+	debugfs_create_atomic_t("allocs", 0444, think->debugfs_dir,
+				&think_lmi_allocs);
+	debugfs_create_u64("enumerate_us", 0444, think->debugfs_dir,
+			   &think->analyze_us);
+	debugfs_create_atomic_t("resumes", 0444, think->debugfs_dir,
+				&think->resume_epoch);
+	debugfs_create_file("capture", 0600, think->debugfs_dir, NULL,
+			    &think_lmi_capture_fops);
+
+	stats_dir = debugfs_create_dir("stats", think->debugfs_dir);
+	for (i = 0; i < ARRAY_SIZE(think_lmi_stats); i++)
+		debugfs_create_file(think_lmi_stats[i].name, 0444, stats_dir,
+				    &think_lmi_stats[i],
+				    &think_lmi_stats_fops);
+}
+
+static void think_lmi_detect_features(struct think_lmi *think)
+{
 	if (wmi_has_guid(LENOVO_SET_BIOS_SETTINGS_GUID) &&
 	    wmi_has_guid(LENOVO_SAVE_BIOS_SETTINGS_GUID))
 		think->can_set_bios_settings = true;
@@ -900,11 +3503,43 @@ static int think_lmi_add(struct wmi_device *wdev)
 		return -ENOMEM;
 
 	think->wmi_device = wdev;
+	/* Asynchronous requests may block in the BIOS for a long time */
+	think->async_wq = alloc_workqueue("think-lmi", WQ_UNBOUND, 0);
+	if (!think->async_wq) {
+		kfree(think);
+		return -ENOMEM;
+	}
+	/* Preallocated so that recording a change never allocates */
+	think->changes = kvmalloc_array(TLMI_CHANGE_RING,
+					sizeof(*think->changes),
+					GFP_KERNEL | __GFP_ZERO);
+	if (!think->changes) {
+		destroy_workqueue(think->async_wq);
+		kfree(think);
+		return -ENOMEM;
+	}
+	hash_init(think->setting_hash);
+	hash_init(think->choices_hash);
+	init_rwsem(&think->cache_sem);
+	mutex_init(&think->wmi_lock);
+	mutex_init(&think->change_lock);
+	INIT_LIST_HEAD(&think->watchers);
+	init_waitqueue_head(&think->event_wait);
+	INIT_WORK(&think->analyze_work, think_lmi_analyze_work);
+	INIT_WORK(&think->resume_work, think_lmi_resume_work);
+	init_completion(&think->analyze_done);
 	dev_set_drvdata(&wdev->dev, think);
 
+	think_lmi_detect_quirks();
+	think_lmi_detect_features(think);
+	think_lmi_debugfs_init(think);
 	think_lmi_chardev_initialize(think);
 
-	think_lmi_analyze(think);
+	/*
+	 * Enumerating the settings takes one WMI query per item, so do it
+	 * off the probe path and let ioctls wait for it where needed.
+	 */
+	queue_work(system_long_wq, &think->analyze_work);
 	return 0;
 }
 
@@ -921,11 +3556,19 @@ think_lmi_remove(struct wmi_device *wdev)
 
 	think = dev_get_drvdata(&wdev->dev);
 	think_lmi_chardev_exit(think);
-
-	for (i = 0; think->settings[i]; ++i) {
-		kfree(think->settings[i]);
-		think->settings[i] = NULL;
+	destroy_workqueue(think->async_wq);
+	WRITE_ONCE(think->unloading, true);
+	cancel_work_sync(&think->analyze_work);
+	cancel_work_sync(&think->resume_work);
+	debugfs_remove_recursive(think->debugfs_dir);
+
+	for (i = 0; i < think->settings_size; ++i) {
+		kvfree(think->settings[i].value);
+		think_lmi_put_choices(think->settings[i].choices);
 	}
+	kfree(think->settings);
+	kfree(think->names);
+	kvfree(think->changes);
 
 	kfree(think);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0))
@@ -953,6 +3596,7 @@ static const struct wmi_device_id think_lmi_id_table[] = {
 static struct wmi_driver think_lmi_driver = {
 	.driver = {
 		.name = "think-lmi",
+		.pm = &think_lmi_pm_ops,
 	},
 	.id_table = think_lmi_id_table,
 	.probe = think_lmi_probe,
@@ -965,12 +3609,21 @@ static struct wmi_driver think_lmi_driver = {
 
 static int __init think_lmi_init(void)
 {
-	return wmi_driver_register(&think_lmi_driver);
+	int ret;
+
+	ret = think_lmi_capture_set(capture);
+	if (ret)
+		return ret;
+	ret = wmi_driver_register(&think_lmi_driver);
+	if (ret)
+		think_lmi_capture_free();
+	return ret;
 }
 
 static void __exit think_lmi_exit(void)
 {
 	wmi_driver_unregister(&think_lmi_driver);
+	think_lmi_capture_free();
 }
 
 module_init(think_lmi_init);
@@ -4,6 +4,7 @@
 #define _THINK_LMI_H_
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define TLMI_SETTINGS_MAXLEN 512
 #define TLMI_PWD_MAXLEN       64
@@ -12,14 +13,212 @@
 #define TLMI_ENC_MAXLEN       64
 #define TLMI_LANG_MAXLEN       4
 #define TLMI_MAX_SETTINGS    255
+#define TLMI_BATCH_MAX       TLMI_MAX_SETTINGS
 /*
  * Longest string should be in the set command: allow size of BIOS
  * option and choice
  */
 #define TLMI_GETSET_MAXLEN (TLMI_SETTINGS_MAXLEN + TLMI_SETTINGS_MAXLEN)
 
+/* One entry of a THINKLMI_BATCH_SET request */
+struct tlmi_setting_pair {
+	char name[TLMI_SETTINGS_MAXLEN];
+	char value[TLMI_SETTINGS_MAXLEN];
+	__s32 status;	/* Out: 0, or a negative errno for this item */
+};
+
+/*
+ * Set up to TLMI_BATCH_MAX settings and save them once. On failure all
+ * pending changes are discarded. 'failed' is the index of the item that
+ * failed, 'count' if the final save failed, or -1 on success. Items that
+ * were not attempted report -ECANCELED.
+ */
+struct tlmi_batch_set {
+	__u32 count;
+	__s32 failed;
+	__u64 items;	/* struct tlmi_setting_pair * */
+};
+
+/*
+ * One Lenovo_lmiopcode directive of a THINKLMI_OPCODE_SEQ request, sent
+ * as "WmiOpcode<opcode>:<arg>;". An empty 'arg' is still sent, as
+ * "WmiOpcode<opcode>:;", like an empty current password. Directives that
+ * take no argument, like "PasswordSetUpdate", set TLMI_OPCODE_NO_ARG and
+ * are sent as "WmiOpcode<opcode>;" with 'arg' left empty. 'opcode' is
+ * letters and digits only, like "PasswordAdmin", and 'arg' may not
+ * contain ';'.
+ */
+#define TLMI_OPCODE_MAXLEN  64
+#define TLMI_OPCODE_SEQ_MAX 16
+#define TLMI_OPCODE_NO_ARG  (1 << 0)
+
+struct tlmi_opcode {
+	char opcode[TLMI_OPCODE_MAXLEN];
+	char arg[TLMI_SETTINGS_MAXLEN];
+	__s32 status;	/* Out: 0, or a negative errno for this step */
+	__u32 flags;
+};
+
+/*
+ * Send up to TLMI_OPCODE_SEQ_MAX directives back to back, with no other
+ * change in between. All of them are checked before the first is sent.
+ * With TLMI_OPCODE_SAVE the BIOS settings are saved after the last one.
+ * 'failed' is the index of the step that failed, 'count' if the save
+ * failed, or -1 on success. Steps that were not attempted report
+ * -ECANCELED. If a step fails after others were sent, pending changes
+ * are discarded.
+ */
+#define TLMI_OPCODE_SAVE (1 << 0)
+
+struct tlmi_opcode_seq {
+	__u32 count;
+	__s32 failed;
+	__u32 flags;
+	__u32 reserved;
+	__u64 steps;	/* struct tlmi_opcode * */
+};
+
+/*
+ * Read several settings at once. Keys are either an array of 'count'
+ * setting indices (__s32), or with TLMI_VEC_BY_NAME 'count' packed
+ * NUL-terminated names, each shorter than TLMI_SETTINGS_MAXLEN, taking
+ * 'keys_len' bytes. For each key a record is
+ * written to 'buf', followed by the setting name, value and choices as
+ * NUL-terminated strings. Records are padded to 8 bytes.
+ *
+ * 'done' returns the number of records written and 'needed' the buffer
+ * size for all of them. If they don't fit, ENOSPC is returned after the
+ * records that did.
+ */
+#define TLMI_VEC_MAX     1024
+#define TLMI_VEC_BY_NAME (1 << 0)
+#define TLMI_VEC_REFRESH (1 << 1) /* Bypass the driver's cache */
+
+struct tlmi_get_vec {
+	__u32 count;
+	__u32 flags;
+	__u64 keys;
+	__u32 keys_len;
+	__u32 buf_len;
+	__u64 buf;
+	__u32 done;	/* Out */
+	__u32 needed;	/* Out */
+};
+
+struct tlmi_vec_record {
+	__s32 index;	/* Setting index, -1 if the key is unknown */
+	__s32 status;	/* 0, or a negative errno with no strings */
+	__u32 name_len;	/* String lengths include the NUL */
+	__u32 value_len;
+	__u32 choices_len; /* 0 if the BIOS doesn't list choices */
+	__u32 reserved;
+};
+
+#define TLMI_VEC_RECORD_SIZE(rec)					\
+	((sizeof(struct tlmi_vec_record) + (rec)->name_len +		\
+	  (rec)->value_len + (rec)->choices_len + 7) & ~7UL)
+
+/*
+ * Buffer descriptor for the v2 ioctls. They take 'in_len' bytes of input
+ * from 'in', which need not be NUL-terminated, and copy only the bytes
+ * used to 'out'. 'out_len' is the size of 'out' and is updated with the
+ * size of the result. If 'out' is too small, ENOSPC is returned and
+ * 'out_len' holds the size needed.
+ *
+ * THINKLMI_GET_SETTINGS_STRING_V2 takes a __u32 setting index as input.
+ * The other v2 ioctls take the same strings as their v1 counterparts.
+ */
+struct tlmi_buf {
+	__u64 in;
+	__u64 out;
+	__u32 in_len;
+	__u32 out_len;
+};
+
+/*
+ * Asynchronous requests. THINKLMI_ASYNC_SUBMIT queues an operation and
+ * returns a ticket straight away. When the operation finishes, a struct
+ * tlmi_completion carrying the ticket can be read() from the same file,
+ * which then polls readable, and the eventfd set with
+ * THINKLMI_ASYNC_EVENTFD, if any, is signalled.
+ *
+ * The requests of one open file run one at a time in the order they were
+ * submitted, so they also complete in that order. Those of different
+ * files run in parallel, in no particular order.
+ *
+ * TLMI_ASYNC_SHOW and TLMI_ASYNC_REFRESH take a setting name and return
+ * what THINKLMI_SHOW_SETTING and THINKLMI_REFRESH_SETTING would.
+ * TLMI_ASYNC_SET takes "Item,Value" and returns the valid choices if it
+ * fails with EINVAL. TLMI_ASYNC_SAVE takes no input.
+ */
+#define TLMI_ASYNC_SHOW    1
+#define TLMI_ASYNC_REFRESH 2
+#define TLMI_ASYNC_SET     3
+#define TLMI_ASYNC_SAVE    4
+#define TLMI_ASYNC_MAX    64 /* Requests pending or unread per open file */
+
+struct tlmi_async_req {
+	__u32 op;
+	__u32 in_len;
+	__u64 in;
+	__u64 ticket;	/* Out */
+};
+
+/*
+ * read() returns whole records, each starting with this header. It fails
+ * with EINVAL if the buffer is too small for the next record.
+ */
+struct tlmi_event {
+	__u32 type;
+	__u32 size;	/* Of the whole record, a multiple of 8 */
+};
+
+#define TLMI_EVENT_COMPLETION 1
+
+struct tlmi_completion {
+	struct tlmi_event hdr;
+	__u64 ticket;
+	__u32 op;
+	__s32 status;	/* 0, or a negative errno */
+	__u32 len;	/* Bytes of data, including the NUL */
+	__u32 reserved;
+	char data[];
+};
+
+/*
+ * Change events, read() by files that enabled them with THINKLMI_WATCH.
+ * One record is returned per successful change, in order. 'count' is the
+ * number of setting indices that follow, or 0 if any setting may have
+ * changed. A reader that falls too far behind gets a single
+ * TLMI_CHANGE_LOST record and should re-read everything it watches.
+ * Only watching files that enabled O_ASYNC are sent SIGIO on a change.
+ */
+#define TLMI_EVENT_CHANGE 2
+
+#define TLMI_CHANGE_SET          1
+#define TLMI_CHANGE_SAVE         2
+#define TLMI_CHANGE_LOAD_DEFAULT 3
+#define TLMI_CHANGE_TPM          4
+#define TLMI_CHANGE_PASSWORD     5
+#define TLMI_CHANGE_LOST         6
+
+struct tlmi_change {
+	struct tlmi_event hdr;
+	__u64 generation; /* Increases by one per change */
+	__u32 reason;
+	__u32 count;
+	__s32 index[];
+};
+
 #define THINKLMI_GET_SETTINGS        _IOR('T', 1, int *)
 #define THINKLMI_GET_SETTINGS_STRING _IOWR('T', 2, char *)
+/*
+ * Fails with EINVAL without calling the BIOS if the value is not one of
+ * the setting's choices. The buffer then holds the list of valid choices,
+ * cut to TLMI_SETTINGS_MAXLEN for the v1 command. THINKLMI_SET_SETTING_V2
+ * returns the whole list, or fails with ENOSPC and sets 'out_len' to the
+ * size needed if it doesn't fit.
+ */
 #define THINKLMI_SET_SETTING         _IOW('T', 3, char *)
 #define THINKLMI_SHOW_SETTING        _IOWR('T', 4, char *)
 #define THINKLMI_AUTHENTICATE        _IOW('T', 5, char *)
@@ -29,6 +228,27 @@
 #define THINKLMI_TPMTYPE             _IOW('T', 10, char *)
 #define THINKLMI_LOAD_DEFAULT        _IOW('T', 11, char *)
 #define THINKLMI_SAVE_SETTINGS       _IOW('T', 12, char *)
+/* As THINKLMI_SHOW_SETTING, but bypass the driver's cached value */
+#define THINKLMI_REFRESH_SETTING     _IOWR('T', 13, char *)
+#define THINKLMI_BATCH_SET           _IOWR('T', 14, struct tlmi_batch_set)
+#define THINKLMI_GET_VEC             _IOWR('T', 15, struct tlmi_get_vec)
+
+#define THINKLMI_GET_SETTINGS_STRING_V2 _IOWR('T', 16, struct tlmi_buf)
+#define THINKLMI_SET_SETTING_V2         _IOWR('T', 17, struct tlmi_buf)
+#define THINKLMI_SHOW_SETTING_V2        _IOWR('T', 18, struct tlmi_buf)
+#define THINKLMI_REFRESH_SETTING_V2     _IOWR('T', 19, struct tlmi_buf)
+#define THINKLMI_AUTHENTICATE_V2        _IOW('T', 20, struct tlmi_buf)
+#define THINKLMI_CHANGE_PASSWORD_V2     _IOW('T', 21, struct tlmi_buf)
+#define THINKLMI_DEBUG_V2               _IOW('T', 22, struct tlmi_buf)
+#define THINKLMI_LMIOPCODE_V2           _IOW('T', 23, struct tlmi_buf)
+#define THINKLMI_TPMTYPE_V2             _IOW('T', 24, struct tlmi_buf)
+
+#define THINKLMI_ASYNC_SUBMIT  _IOWR('T', 25, struct tlmi_async_req)
+/* Signal this eventfd on every completion, or stop if it is -1 */
+#define THINKLMI_ASYNC_EVENTFD _IOW('T', 26, int)
+/* Enable (arg 1) or disable (arg 0) change events on this file */
+#define THINKLMI_WATCH         _IO('T', 27)
+#define THINKLMI_OPCODE_SEQ    _IOWR('T', 28, struct tlmi_opcode_seq)
 
 #endif /* !_THINK_LMI_H_ */
 
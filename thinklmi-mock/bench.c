@@ -0,0 +1,1324 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Benchmark of the think-lmi driver built for userspace, running against
+ * the fake BIOS. For each workload it reports operations per second and
+ * how many WMI queries and method calls each operation cost.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "think-lmi.h"
+#include "mock.h"
+
+#define BENCH_VALUE_MAXLEN 64
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_setting {
+	char name[TLMI_SETTINGS_MAXLEN];
+	int slot;	/* Instance in the fake BIOS */
+	const char *choices;
+	/* Two of its choices to switch between, if it has a plain list */
+	char values[2][BENCH_VALUE_MAXLEN];
+	bool toggle;
+};
+
+static struct bench_setting *settings;
+static int nsettings;
+static int *toggles;	/* Indices of the settings with values[] */
+static int ntoggles;
+
+static int iterations = 1000;
+static int probes = 20;
+static int batch_size = 8;
+static int max_threads = 4;
+static const char *password;
+static int failures;
+/* What the budgets depend on, see bench_budgets() */
+static int calls_per_method;	/* 2 with the duplicate call quirk */
+static int selections;		/* Choices are read with a method call */
+
+struct bench_counts {
+	double start;
+	unsigned long allocs;
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_start(struct bench_counts *c)
+{
+	fake_bios_reset_calls();
+	c->allocs = kshim_allocs();
+	c->start = bench_now();
+}
+
+static void bench_fail(const char *what, long ret)
+{
+	fprintf(stderr, "%s failed: %s\n", what, strerror(-ret));
+	failures++;
+}
+
+/*
+ * Print a row and check that its operations cost exactly the WMI calls
+ * budgeted for each, so an extra call or a cache that stopped working
+ * fails the run like a wrong value does.
+ */
+static void bench_row(const char *name, unsigned long ops, double secs,
+		      unsigned long queries, unsigned long methods,
+		      unsigned long allocs, long query_budget,
+		      long method_budget)
+{
+	if (!ops)
+		ops = 1;
+	printf("%-14s %8lu %12.0f %10.2f %10.2f %10.2f\n", name, ops,
+	       secs > 0 ? ops / secs : 0, (double)queries / ops,
+	       (double)methods / ops, (double)allocs / ops);
+	if (queries != query_budget * ops || methods != method_budget * ops) {
+		fprintf(stderr, "%s: %.2f queries and %.2f method calls per "
+			"operation, budget is %ld and %ld\n", name,
+			(double)queries / ops, (double)methods / ops,
+			query_budget, method_budget);
+		failures++;
+	}
+}
+
+static void bench_report(const char *name, struct bench_counts *c,
+			 unsigned long ops, long query_budget,
+			 long method_budget)
+{
+	bench_row(name, ops, bench_now() - c->start, fake_bios_queries(),
+		  fake_bios_methods(), kshim_allocs() - c->allocs,
+		  query_budget, method_budget);
+}
+
+static struct file *bench_open(void)
+{
+	char auth[128];
+	struct file *file;
+	int err;
+
+	file = kshim_dev_open(0, &err);
+	if (!file) {
+		fprintf(stderr, "open failed: %s\n", strerror(-err));
+		exit(1);
+	}
+	if (password) {
+		snprintf(auth, sizeof(auth), "%s,ascii,us", password);
+		err = kshim_dev_ioctl(file, THINKLMI_AUTHENTICATE, auth);
+		if (err)
+			bench_fail("THINKLMI_AUTHENTICATE", err);
+	}
+	return file;
+}
+
+/* Bind the driver and wait for it to enumerate the settings */
+static void bench_probe(void)
+{
+	struct file *file;
+	long ret;
+	int count;
+
+	ret = kshim_wmi_probe();
+	if (ret) {
+		fprintf(stderr, "probe failed: %s\n", strerror(-ret));
+		exit(1);
+	}
+	file = bench_open();
+	ret = kshim_dev_ioctl(file, THINKLMI_GET_SETTINGS, &count);
+	if (ret)
+		bench_fail("THINKLMI_GET_SETTINGS", ret);
+	kshim_dev_close(file);
+}
+
+static long bench_v2(struct file *file, unsigned int cmd, const void *in,
+		     size_t in_len, void *out, size_t out_len)
+{
+	struct tlmi_buf req = {
+		.in = (uintptr_t)in,
+		.in_len = in_len,
+		.out = (uintptr_t)out,
+		.out_len = out_len,
+	};
+
+	return kshim_dev_ioctl(file, cmd, &req);
+}
+
+/* Pick the first two entries of a plain choice list */
+static bool bench_split_choices(struct bench_setting *s)
+{
+	const char *p = s->choices;
+	size_t len;
+	int i;
+
+	if (!p || strpbrk(p, ":["))
+		return false;
+	for (i = 0; i < 2; i++) {
+		len = strcspn(p, ",");
+		if (!len || len >= BENCH_VALUE_MAXLEN)
+			return false;
+		memcpy(s->values[i], p, len);
+		s->values[i][len] = '\0';
+		p += len;
+		if (!*p)
+			return i == 1;
+		p++;
+	}
+	return true;
+}
+
+/* Learn the settings' names from the driver and their choices from the BIOS */
+static void bench_discover(void)
+{
+	struct bench_setting *s;
+	struct file *file;
+	__u32 index;
+	int slots = fake_bios_slots();
+
+	settings = calloc(slots, sizeof(*settings));
+	toggles = calloc(slots, sizeof(*toggles));
+	if (!settings || !toggles)
+		exit(1);
+
+	file = bench_open();
+	for (index = 0; index < slots; index++) {
+		s = &settings[nsettings];
+		if (bench_v2(file, THINKLMI_GET_SETTINGS_STRING_V2, &index,
+			     sizeof(index), s->name, sizeof(s->name)))
+			continue;
+		s->slot = index;
+		s->choices = fake_bios_choices(index);
+		s->toggle = bench_split_choices(s);
+		if (s->toggle)
+			toggles[ntoggles++] = nsettings;
+		nsettings++;
+	}
+	kshim_dev_close(file);
+
+	if (!nsettings) {
+		fprintf(stderr, "the driver found no settings\n");
+		exit(1);
+	}
+}
+
+/* The quirks the driver applies, as reported in debugfs */
+static void bench_budgets(void)
+{
+	char buf[32];
+	unsigned long quirks;
+
+	if (kshim_debugfs_read("think-lmi/quirks", buf, sizeof(buf)) <= 0) {
+		fprintf(stderr, "reading the quirks failed\n");
+		exit(1);
+	}
+	quirks = strtoul(buf, NULL, 0);
+	calls_per_method = quirks & 1 ? 2 : 1;
+	selections = fake_bios_has(FAKE_GET_BIOS_SELECTIONS);
+}
+
+/* Export the driver's capture, as cat would from debugfs */
+static void bench_save_capture(const char *path)
+{
+	size_t size = 64 << 20;
+	char *buf;
+	ssize_t len;
+	FILE *fp;
+
+	buf = malloc(size);
+	if (!buf)
+		exit(1);
+	len = kshim_debugfs_read("think-lmi/capture", buf, size);
+	if (len < 0) {
+		bench_fail("reading the capture", len);
+		goto out;
+	}
+	fp = fopen(path, "w");
+	if (!fp || fwrite(buf, 1, len, fp) != len) {
+		bench_fail(path, -errno);
+		if (fp)
+			fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+out:
+	free(buf);
+}
+
+/*
+ * Bind the driver probes times, leaving it unbound, and report what
+ * enumerating the settings took. Work the probe leaves running in the
+ * background is waited for before counting calls, but isn't timed.
+ */
+static void bench_probes(const char *name, long query_budget,
+			 long method_budget)
+{
+	unsigned long queries = 0, methods = 0, allocs = 0, before;
+	double busy = 0, start;
+	int i;
+
+	kshim_wmi_remove();
+	for (i = 0; i < probes; i++) {
+		fake_bios_reset_calls();
+		before = kshim_allocs();
+		start = bench_now();
+		bench_probe();
+		busy += bench_now() - start;
+		kshim_flush_workqueues();
+		queries += fake_bios_queries();
+		methods += fake_bios_methods();
+		allocs += kshim_allocs() - before;
+		kshim_wmi_remove();
+	}
+	bench_row(name, probes, busy, queries, methods, allocs, query_budget,
+		  method_budget);
+}
+
+/*
+ * Probe again with the snapshot the driver exported loaded as firmware,
+ * as on a second boot with the same BIOS. Only the first and last
+ * settings are read to check it. Then rename the last setting, as a BIOS
+ * update might, which must make the driver drop the snapshot and scan.
+ */
+static void bench_snapshot(void)
+{
+	static char buf[1 << 20];
+	char dir[] = "/tmp/think-lmi-bench.XXXXXX";
+	char path[sizeof(dir) + 32];
+	char name[TLMI_SETTINGS_MAXLEN];
+	int last = settings[nsettings - 1].slot;
+	int loglevel;
+	ssize_t len;
+	FILE *fp;
+
+	len = kshim_debugfs_read("think-lmi/snapshot", buf, sizeof(buf));
+	if (len <= 0) {
+		bench_fail("reading the snapshot", len ? len : -ENODATA);
+		return;
+	}
+	if (!mkdtemp(dir)) {
+		bench_fail("mkdtemp", -errno);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/think-lmi-settings.bin", dir);
+	fp = fopen(path, "wb");
+	if (!fp || fwrite(buf, 1, len, fp) != len) {
+		bench_fail("writing the snapshot", -EIO);
+		if (fp)
+			fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+
+	kshim_firmware_dir = dir;
+	bench_probes("snapshot", nsettings > 1 ? 2 : 1, 0);
+	snprintf(name, sizeof(name), "%s", fake_bios_name(last));
+	fake_bios_rename(last, "RenamedByUpdate");
+	/* Each probe warns about the stale snapshot, which is expected */
+	loglevel = kshim_loglevel;
+	kshim_loglevel = 0;
+	/* The check reads the first and last settings, then the scan */
+	bench_probes("snapshot-stale", (nsettings > 1 ? 2 : 1) +
+		     fake_bios_slots(), 0);
+	kshim_loglevel = loglevel;
+	fake_bios_rename(last, name);
+	kshim_firmware_dir = NULL;
+out:
+	unlink(path);
+	rmdir(dir);
+	bench_probe();
+}
+
+static long bench_show(struct file *file, unsigned int cmd, int i,
+		       char *out, size_t size)
+{
+	struct bench_setting *s = &settings[i];
+
+	return bench_v2(file, cmd, s->name, strlen(s->name), out, size);
+}
+
+/* Show every setting once, uncounted, so the cache holds them all */
+static void bench_warm(struct file *file)
+{
+	char out[TLMI_SETTINGS_MAXLEN * 4];
+	long ret;
+	int i;
+
+	for (i = 0; i < nsettings; i++) {
+		ret = bench_show(file, THINKLMI_SHOW_SETTING_V2, i, out,
+				 sizeof(out));
+		if (ret)
+			bench_fail(settings[i].name, ret);
+	}
+}
+
+/* Every setting once with an empty cache, then cached reads */
+static void bench_show_all(void)
+{
+	static char out[TLMI_SETTINGS_MAXLEN * 4];
+	char cmd[TLMI_GETSET_MAXLEN];
+	struct bench_counts c;
+	struct file *file;
+	long ret;
+	int i;
+
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < nsettings; i++) {
+		ret = bench_show(file, THINKLMI_SHOW_SETTING_V2, i, out,
+				 sizeof(out));
+		if (ret)
+			bench_fail(settings[i].name, ret);
+	}
+	bench_report("show-cold", &c, nsettings, 1, selections);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_show(file, THINKLMI_SHOW_SETTING_V2, i % nsettings,
+				 out, sizeof(out));
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("show", &c, iterations, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_show(file, THINKLMI_REFRESH_SETTING_V2,
+				 i % nsettings, out, sizeof(out));
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("refresh", &c, iterations, 1, selections);
+
+	/* The v1 commands take the name in a buffer of fixed size */
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		memset(cmd, 0, sizeof(cmd));
+		strcpy(cmd, settings[i % nsettings].name);
+		ret = kshim_dev_ioctl(file, THINKLMI_SHOW_SETTING, cmd);
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("show-v1", &c, iterations, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		memset(cmd, 0, sizeof(cmd));
+		strcpy(cmd, settings[i % nsettings].name);
+		ret = kshim_dev_ioctl(file, THINKLMI_REFRESH_SETTING, cmd);
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("refresh-v1", &c, iterations, 1, selections);
+	kshim_dev_close(file);
+}
+
+static long bench_set_one(struct file *file, int i, int round)
+{
+	struct bench_setting *s = &settings[i];
+	char cmd[TLMI_SETTINGS_MAXLEN + BENCH_VALUE_MAXLEN];
+	char out[TLMI_SETTINGS_MAXLEN];
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), "%s,%s", s->name,
+		       s->values[round & 1]);
+	return bench_v2(file, THINKLMI_SET_SETTING_V2, cmd, len, out,
+			sizeof(out));
+}
+
+static void bench_set(void)
+{
+	char cmd[TLMI_GETSET_MAXLEN];
+	struct bench_setting *s;
+	struct bench_counts c;
+	struct file *file;
+	long ret;
+	int i;
+
+	if (!ntoggles) {
+		printf("%-14s no settings with a plain choice list\n", "set");
+		return;
+	}
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_set_one(file, toggles[i % ntoggles],
+				    i / ntoggles);
+		if (ret)
+			bench_fail("THINKLMI_SET_SETTING_V2", ret);
+	}
+	/* Set and save */
+	bench_report("set", &c, iterations, 0, 2 * calls_per_method);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		s = &settings[toggles[i % ntoggles]];
+		memset(cmd, 0, sizeof(cmd));
+		snprintf(cmd, sizeof(cmd), "%s,%s", s->name,
+			 s->values[(i / ntoggles) & 1]);
+		ret = kshim_dev_ioctl(file, THINKLMI_SET_SETTING, cmd);
+		if (ret)
+			bench_fail("THINKLMI_SET_SETTING", ret);
+	}
+	bench_report("set-v1", &c, iterations, 0, 2 * calls_per_method);
+	kshim_dev_close(file);
+}
+
+static void bench_batch(void)
+{
+	struct tlmi_setting_pair *items;
+	struct tlmi_batch_set batch;
+	struct bench_counts c;
+	struct bench_setting *s;
+	struct file *file;
+	int i, j, n, ops;
+	long ret;
+
+	n = batch_size < ntoggles ? batch_size : ntoggles;
+	if (n < 1) {
+		printf("%-14s no settings with a plain choice list\n", "batch");
+		return;
+	}
+	items = calloc(n, sizeof(*items));
+	if (!items)
+		exit(1);
+	ops = (iterations + n - 1) / n;
+
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < ops; i++) {
+		for (j = 0; j < n; j++) {
+			s = &settings[toggles[j]];
+			strcpy(items[j].name, s->name);
+			strcpy(items[j].value, s->values[i & 1]);
+		}
+		batch = (struct tlmi_batch_set) {
+			.count = n,
+			.items = (uintptr_t)items,
+		};
+		ret = kshim_dev_ioctl(file, THINKLMI_BATCH_SET, &batch);
+		if (ret)
+			bench_fail("THINKLMI_BATCH_SET", ret);
+	}
+	/* A set for each item and one save */
+	bench_report("batch", &c, ops, 0, (n + 1) * calls_per_method);
+	kshim_dev_close(file);
+	free(items);
+}
+
+/* Send a THINKLMI_OPCODE_SEQ request, reporting the step that failed */
+static void bench_opcode_seq(struct file *file, struct tlmi_opcode *steps,
+			     int count)
+{
+	struct tlmi_opcode_seq seq = {
+		.count = count,
+		.steps = (uintptr_t)steps,
+	};
+	long ret;
+	int i;
+
+	ret = kshim_dev_ioctl(file, THINKLMI_OPCODE_SEQ, &seq);
+	if (!ret)
+		return;
+	for (i = 0; i < count; i++) {
+		if (steps[i].status && steps[i].status != -ECANCELED)
+			bench_fail(steps[i].opcode, steps[i].status);
+	}
+	bench_fail("THINKLMI_OPCODE_SEQ", ret);
+}
+
+/*
+ * The password change sequence of THINKLMI_LMIOPCODE, sent with
+ * THINKLMI_OPCODE_SEQ, then again setting a first password, whose
+ * current password is sent empty. Then with the v1 command, which runs
+ * the same steps with empty passwords, and THINKLMI_TPMTYPE. The fake
+ * BIOS checks the form of each directive, but they have no effect.
+ */
+static void bench_opcode(void)
+{
+	static const char * const opcodes[] = {
+		"PasswordAdmin", "PasswordType", "PasswordCurrent01",
+		"PasswordNew01", "PasswordSetUpdate",
+	};
+	struct tlmi_opcode steps[ARRAY_SIZE(opcodes)];
+	char cmd[TLMI_GETSET_MAXLEN];
+	struct bench_counts c;
+	struct file *file;
+	long ret;
+	int i;
+
+	memset(steps, 0, sizeof(steps));
+	for (i = 0; i < ARRAY_SIZE(opcodes); i++)
+		strcpy(steps[i].opcode, opcodes[i]);
+	snprintf(steps[0].arg, sizeof(steps[0].arg), "%s",
+		 password ? password : "");
+	strcpy(steps[1].arg, "pop");
+	strcpy(steps[2].arg, "oldpop");
+	strcpy(steps[3].arg, "newpop");
+	steps[4].flags = TLMI_OPCODE_NO_ARG;
+
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < iterations; i++)
+		bench_opcode_seq(file, steps, ARRAY_SIZE(steps));
+	bench_report("opcode-seq", &c, iterations, 0,
+		     ARRAY_SIZE(steps) * calls_per_method);
+
+	steps[2].arg[0] = '\0';
+	bench_start(&c);
+	for (i = 0; i < iterations; i++)
+		bench_opcode_seq(file, steps, ARRAY_SIZE(steps));
+	bench_report("opcode-first", &c, iterations, 0,
+		     ARRAY_SIZE(steps) * calls_per_method);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		memset(cmd, 0, sizeof(cmd));
+		snprintf(cmd, sizeof(cmd), "%s,pop,,;",
+			 password ? password : "");
+		ret = kshim_dev_ioctl(file, THINKLMI_LMIOPCODE, cmd);
+		if (ret)
+			bench_fail("THINKLMI_LMIOPCODE", ret);
+	}
+	bench_report("lmiopcode", &c, iterations, 0,
+		     ARRAY_SIZE(steps) * calls_per_method);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_v2(file, THINKLMI_TPMTYPE_V2, "TPM20;", 6, NULL, 0);
+		if (ret)
+			bench_fail("THINKLMI_TPMTYPE_V2", ret);
+	}
+	/* The TPM directive and a save */
+	bench_report("tpmtype", &c, iterations, 0, 2 * calls_per_method);
+	kshim_dev_close(file);
+}
+
+/* The number of settings, and their names by index with both commands */
+static void bench_names(void)
+{
+	char name[TLMI_SETTINGS_MAXLEN];
+	struct bench_counts c;
+	struct file *file;
+	int i, n, count;
+	__u32 index;
+	long ret;
+
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = kshim_dev_ioctl(file, THINKLMI_GET_SETTINGS, &count);
+		if (ret)
+			bench_fail("THINKLMI_GET_SETTINGS", ret);
+		else if (count != nsettings)
+			bench_fail("THINKLMI_GET_SETTINGS", -EIO);
+	}
+	bench_report("count", &c, iterations, 0, 0);
+
+	/* The v1 command takes the index in one byte */
+	for (n = 0; n < nsettings && settings[n].slot <= 255; n++)
+		;
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		memset(name, 0, sizeof(name));
+		name[0] = settings[i % n].slot;
+		ret = kshim_dev_ioctl(file, THINKLMI_GET_SETTINGS_STRING, name);
+		if (ret)
+			bench_fail("THINKLMI_GET_SETTINGS_STRING", ret);
+		else if (strcmp(name, settings[i % n].name))
+			bench_fail(settings[i % n].name, -EIO);
+	}
+	bench_report("name-v1", &c, iterations, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		index = settings[i % nsettings].slot;
+		ret = bench_v2(file, THINKLMI_GET_SETTINGS_STRING_V2, &index,
+			       sizeof(index), name, sizeof(name));
+		if (ret)
+			bench_fail("THINKLMI_GET_SETTINGS_STRING_V2", ret);
+		else if (strcmp(name, settings[i % nsettings].name))
+			bench_fail(settings[i % nsettings].name, -EIO);
+	}
+	bench_report("name", &c, iterations, 0, 0);
+	kshim_dev_close(file);
+}
+
+/* Read every setting with THINKLMI_GET_VEC and check the records */
+static long bench_get_vec(struct file *file, __u32 flags, const void *keys,
+			  size_t keys_len, char *buf, size_t size)
+{
+	struct tlmi_get_vec vec = {
+		.count = nsettings,
+		.flags = flags,
+		.keys = (uintptr_t)keys,
+		.keys_len = keys_len,
+		.buf_len = size,
+		.buf = (uintptr_t)buf,
+	};
+	struct tlmi_vec_record *rec;
+	size_t off = 0;
+	long ret;
+	int i;
+
+	ret = kshim_dev_ioctl(file, THINKLMI_GET_VEC, &vec);
+	if (ret)
+		return ret;
+	if (vec.done != nsettings)
+		return -EIO;
+	for (i = 0; i < nsettings; i++) {
+		rec = (struct tlmi_vec_record *)(buf + off);
+		if (rec->status)
+			return rec->status;
+		if (rec->index != settings[i].slot)
+			return -EIO;
+		off += TLMI_VEC_RECORD_SIZE(rec);
+	}
+	return 0;
+}
+
+/*
+ * Every setting in one THINKLMI_GET_VEC, by index and by name from the
+ * cache, then from the BIOS. Each operation is one call for all of them.
+ */
+static void bench_vec(void)
+{
+	size_t size = 1 << 20, names_len = 0;
+	struct bench_counts c;
+	struct file *file;
+	__s32 *indices;
+	char *names, *buf;
+	long ret;
+	int i, ops;
+
+	indices = calloc(nsettings, sizeof(*indices));
+	names = malloc(nsettings * TLMI_SETTINGS_MAXLEN);
+	buf = malloc(size);
+	if (!indices || !names || !buf)
+		exit(1);
+	for (i = 0; i < nsettings; i++) {
+		indices[i] = settings[i].slot;
+		strcpy(names + names_len, settings[i].name);
+		names_len += strlen(settings[i].name) + 1;
+	}
+	ops = (iterations + nsettings - 1) / nsettings;
+
+	file = bench_open();
+	bench_warm(file);
+	bench_start(&c);
+	for (i = 0; i < ops; i++) {
+		ret = bench_get_vec(file, 0, indices,
+				    nsettings * sizeof(*indices), buf, size);
+		if (ret)
+			bench_fail("THINKLMI_GET_VEC", ret);
+	}
+	bench_report("vec", &c, ops, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < ops; i++) {
+		ret = bench_get_vec(file, TLMI_VEC_BY_NAME, names, names_len,
+				    buf, size);
+		if (ret)
+			bench_fail("THINKLMI_GET_VEC", ret);
+	}
+	bench_report("vec-name", &c, ops, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < ops; i++) {
+		ret = bench_get_vec(file, TLMI_VEC_REFRESH, indices,
+				    nsettings * sizeof(*indices), buf, size);
+		if (ret)
+			bench_fail("THINKLMI_GET_VEC", ret);
+	}
+	bench_report("vec-refresh", &c, ops, nsettings,
+		     nsettings * selections);
+	kshim_dev_close(file);
+	free(indices);
+	free(names);
+	free(buf);
+}
+
+/*
+ * Submit an asynchronous request, wait for the file's eventfd and read
+ * the completion. Returns the status the request completed with.
+ */
+static long bench_async(struct file *file, int efd, __u32 op,
+			const char *in)
+{
+	static char buf[sizeof(struct tlmi_completion) +
+			TLMI_SETTINGS_MAXLEN * 4];
+	struct tlmi_completion *done = (struct tlmi_completion *)buf;
+	struct tlmi_async_req req = {
+		.op = op,
+		.in = (uintptr_t)in,
+		.in_len = strlen(in),
+	};
+	uint64_t events;
+	ssize_t len;
+	long ret;
+
+	ret = kshim_dev_ioctl(file, THINKLMI_ASYNC_SUBMIT, &req);
+	if (ret)
+		return ret;
+	if (read(efd, &events, sizeof(events)) != sizeof(events))
+		return -errno;
+	len = kshim_dev_read(file, buf, sizeof(buf));
+	if (len < 0)
+		return len;
+	if (len < sizeof(*done) || done->hdr.type != TLMI_EVENT_COMPLETION ||
+	    done->ticket != req.ticket || done->op != op)
+		return -EIO;
+	return done->status;
+}
+
+/*
+ * The requests of THINKLMI_ASYNC_SUBMIT, one at a time. They cost what
+ * the commands they stand for do.
+ */
+static void bench_async_all(void)
+{
+	char cmd[TLMI_SETTINGS_MAXLEN + BENCH_VALUE_MAXLEN];
+	struct bench_counts c;
+	struct bench_setting *s;
+	struct file *file;
+	int i, efd;
+	long ret;
+
+	efd = eventfd(0, 0);
+	if (efd < 0) {
+		bench_fail("eventfd", -errno);
+		return;
+	}
+	file = bench_open();
+	ret = kshim_dev_ioctl(file, THINKLMI_ASYNC_EVENTFD, &efd);
+	if (ret) {
+		bench_fail("THINKLMI_ASYNC_EVENTFD", ret);
+		goto out;
+	}
+	bench_warm(file);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_async(file, efd, TLMI_ASYNC_SHOW,
+				  settings[i % nsettings].name);
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("async-show", &c, iterations, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_async(file, efd, TLMI_ASYNC_REFRESH,
+				  settings[i % nsettings].name);
+		if (ret)
+			bench_fail(settings[i % nsettings].name, ret);
+	}
+	bench_report("async-refresh", &c, iterations, 1, selections);
+
+	if (ntoggles) {
+		bench_start(&c);
+		for (i = 0; i < iterations; i++) {
+			s = &settings[toggles[i % ntoggles]];
+			snprintf(cmd, sizeof(cmd), "%s,%s", s->name,
+				 s->values[(i / ntoggles) & 1]);
+			ret = bench_async(file, efd, TLMI_ASYNC_SET, cmd);
+			if (ret)
+				bench_fail("TLMI_ASYNC_SET", ret);
+		}
+		/* Set and save */
+		bench_report("async-set", &c, iterations, 0,
+			     2 * calls_per_method);
+	}
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = bench_async(file, efd, TLMI_ASYNC_SAVE, "");
+		if (ret)
+			bench_fail("TLMI_ASYNC_SAVE", ret);
+	}
+	bench_report("async-save", &c, iterations, 0, calls_per_method);
+out:
+	kshim_dev_close(file);
+	close(efd);
+}
+
+/*
+ * Set a setting on one file and read the change event on another that
+ * watches. The event must name the setting, and reading it must not take
+ * any WMI call.
+ */
+static void bench_watch(void)
+{
+	char buf[sizeof(struct tlmi_change) + sizeof(__s32) * 8];
+	struct tlmi_change *change = (struct tlmi_change *)buf;
+	struct file *file, *watcher;
+	struct bench_counts c;
+	ssize_t len;
+	long ret;
+	int i, j;
+
+	if (!ntoggles) {
+		printf("%-14s no settings with a plain choice list\n", "watch");
+		return;
+	}
+	file = bench_open();
+	watcher = bench_open();
+	ret = kshim_dev_ioctl(watcher, THINKLMI_WATCH, (void *)1);
+	if (ret)
+		bench_fail("THINKLMI_WATCH", ret);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		j = toggles[i % ntoggles];
+		ret = bench_set_one(file, j, i / ntoggles);
+		if (ret) {
+			bench_fail("THINKLMI_SET_SETTING_V2", ret);
+			continue;
+		}
+		len = kshim_dev_read(watcher, buf, sizeof(buf));
+		if (len < 0)
+			bench_fail("reading the change", len);
+		else if (len < sizeof(*change) + sizeof(__s32) ||
+			 change->hdr.type != TLMI_EVENT_CHANGE ||
+			 change->reason != TLMI_CHANGE_SET ||
+			 change->count != 1 ||
+			 change->index[0] != settings[j].slot)
+			bench_fail(settings[j].name, -EIO);
+	}
+	/* Set and save, the event costs nothing */
+	bench_report("watch", &c, iterations, 0, 2 * calls_per_method);
+	kshim_dev_close(watcher);
+	kshim_dev_close(file);
+}
+
+/*
+ * The commands for the BIOS as a whole. Load default leaves the defaults
+ * pending, they are dropped afterwards as a reboot without saving would.
+ * The password is changed to another one and back, so the BIOS is left
+ * as it was.
+ */
+static void bench_admin(void)
+{
+	char cmd[TLMI_GETSET_MAXLEN];
+	const char *pwd = password ? password : "";
+	struct bench_counts c;
+	struct bench_setting *s;
+	struct file *file;
+	int i, len, ops;
+	long ret;
+
+	file = bench_open();
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		len = snprintf(cmd, sizeof(cmd), "%s,ascii,us", pwd);
+		ret = bench_v2(file, THINKLMI_AUTHENTICATE_V2, cmd, len,
+			       NULL, 0);
+		if (ret)
+			bench_fail("THINKLMI_AUTHENTICATE_V2", ret);
+	}
+	bench_report("authenticate", &c, iterations, 0, 0);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = kshim_dev_ioctl(file, THINKLMI_SAVE_SETTINGS, NULL);
+		if (ret)
+			bench_fail("THINKLMI_SAVE_SETTINGS", ret);
+	}
+	bench_report("save", &c, iterations, 0, calls_per_method);
+
+	bench_start(&c);
+	for (i = 0; i < iterations; i++) {
+		ret = kshim_dev_ioctl(file, THINKLMI_LOAD_DEFAULT, NULL);
+		if (ret)
+			bench_fail("THINKLMI_LOAD_DEFAULT", ret);
+	}
+	bench_report("load-default", &c, iterations, 0, calls_per_method);
+	fake_bios_discard();
+
+	if (ntoggles) {
+		s = &settings[toggles[0]];
+		bench_start(&c);
+		for (i = 0; i < iterations; i++) {
+			len = snprintf(cmd, sizeof(cmd), "%s,%s;", s->name,
+				       s->values[i & 1]);
+			ret = bench_v2(file, THINKLMI_DEBUG_V2, cmd, len,
+				       NULL, 0);
+			if (ret)
+				bench_fail("THINKLMI_DEBUG_V2", ret);
+		}
+		bench_report("debug", &c, iterations, 0, calls_per_method);
+	}
+
+	/* An even number of changes ends with the password it started with */
+	ops = (iterations + 1) & ~1;
+	bench_start(&c);
+	for (i = 0; i < ops; i++) {
+		len = snprintf(cmd, sizeof(cmd), "pap,%s,%s,ascii,us;",
+			       i & 1 ? "bench" : pwd, i & 1 ? pwd : "bench");
+		ret = bench_v2(file, THINKLMI_CHANGE_PASSWORD_V2, cmd, len,
+			       NULL, 0);
+		if (ret) {
+			bench_fail("THINKLMI_CHANGE_PASSWORD_V2", ret);
+			break;
+		}
+	}
+	bench_report("password", &c, ops, 0, calls_per_method);
+	kshim_dev_close(file);
+}
+
+/*
+ * Readers show settings that a writer keeps changing. Every value read
+ * must be one of the two the writer sets.
+ */
+struct bench_stress {
+	pthread_t thread;
+	unsigned long ops;
+	unsigned long bad;
+};
+
+/* Whether the driver shows the value the BIOS holds for a setting */
+static bool bench_current(struct file *file, int i)
+{
+	char out[TLMI_SETTINGS_MAXLEN * 4];
+	const char *value = out;
+
+	if (bench_show(file, THINKLMI_SHOW_SETTING_V2, i, out, sizeof(out)))
+		return false;
+	out[strcspn(out, "\n")] = '\0';
+	/* Without choices the whole "Item,Value" string is shown */
+	if (!selections) {
+		value = strchr(out, ',');
+		if (!value)
+			return false;
+		value++;
+	}
+	return !strcmp(value, fake_bios_value(settings[i].slot));
+}
+
+/*
+ * Suspend, change a setting as BIOS setup would, and resume. Once the
+ * driver's resume work is done every setting must read back as the BIOS
+ * holds it, served from the cache.
+ */
+static void bench_resume(void)
+{
+	struct bench_counts c;
+	struct bench_setting *s;
+	struct file *file;
+	int i, j;
+
+	file = bench_open();
+	for (j = 0; j < nsettings; j++) {
+		if (!bench_current(file, j))
+			bench_fail(settings[j].name, -EIO);
+	}
+
+	bench_start(&c);
+	for (i = 0; i < probes; i++) {
+		kshim_wmi_suspend();
+		if (ntoggles) {
+			s = &settings[toggles[i % ntoggles]];
+			fake_bios_change(s->slot, strcmp(fake_bios_value(s->slot),
+							 s->values[0]) ?
+					 s->values[0] : s->values[1]);
+		}
+		kshim_wmi_resume();
+		kshim_flush_workqueues();
+		for (j = 0; j < nsettings; j++) {
+			if (!bench_current(file, j))
+				bench_fail(settings[j].name, -EIO);
+		}
+	}
+	/* The resume work reads every cached setting again */
+	bench_report("resume", &c, probes, nsettings, 0);
+	kshim_dev_close(file);
+}
+
+static bool stress_running;
+
+static void *bench_stress_reader(void *arg)
+{
+	struct bench_stress *st = arg;
+	char out[TLMI_SETTINGS_MAXLEN * 4];
+	struct bench_setting *s;
+	struct file *file;
+	size_t len;
+	long ret;
+	int i;
+
+	file = bench_open();
+	for (i = 0; i < iterations; i++) {
+		s = &settings[toggles[i % ntoggles]];
+		ret = bench_show(file, THINKLMI_SHOW_SETTING_V2,
+				 toggles[i % ntoggles], out, sizeof(out));
+		len = strcspn(out, "\n");
+		out[len] = '\0';
+		if (ret || (strcmp(out, s->values[0]) &&
+			    strcmp(out, s->values[1])))
+			st->bad++;
+		st->ops++;
+	}
+	kshim_dev_close(file);
+	return NULL;
+}
+
+static void *bench_stress_writer(void *arg)
+{
+	struct bench_stress *st = arg;
+	struct file *file;
+	int i;
+
+	file = bench_open();
+	for (i = 0; __atomic_load_n(&stress_running, __ATOMIC_RELAXED); i++) {
+		if (bench_set_one(file, toggles[i % ntoggles], i / ntoggles))
+			st->bad++;
+		st->ops++;
+	}
+	kshim_dev_close(file);
+	return NULL;
+}
+
+static void bench_stress(void)
+{
+	struct bench_stress *readers, writer;
+	unsigned long ops, bad;
+	double start, secs;
+	int n, i;
+
+	if (!ntoggles) {
+		printf("%-14s no settings with a plain choice list\n",
+		       "stress");
+		return;
+	}
+	readers = calloc(max_threads, sizeof(*readers));
+	if (!readers)
+		exit(1);
+
+	printf("\n%-14s %8s %12s %12s %8s\n", "stress", "readers",
+	       "reads/sec", "writes/sec", "errors");
+	for (n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		memset(readers, 0, n * sizeof(*readers));
+		memset(&writer, 0, sizeof(writer));
+		stress_running = true;
+		start = bench_now();
+		pthread_create(&writer.thread, NULL, bench_stress_writer,
+			       &writer);
+		for (i = 0; i < n; i++)
+			pthread_create(&readers[i].thread, NULL,
+				       bench_stress_reader, &readers[i]);
+		ops = bad = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(readers[i].thread, NULL);
+			ops += readers[i].ops;
+			bad += readers[i].bad;
+		}
+		secs = bench_now() - start;
+		__atomic_store_n(&stress_running, false, __ATOMIC_RELAXED);
+		pthread_join(writer.thread, NULL);
+		bad += writer.bad;
+
+		printf("%-14s %8d %12.0f %12.0f %8lu\n", "", n, ops / secs,
+		       writer.ops / secs, bad);
+		if (bad)
+			failures++;
+		if (n == max_threads)
+			break;
+	}
+	free(readers);
+}
+
+static bool bench_selected(const char *name, const char * const *list,
+			   int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(list[i], name))
+			return true;
+	}
+	return false;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] [workload...]\n"
+		"  -f FILE      load the fake BIOS from a script\n"
+		"  -r FILE      load it from a trace captured by the driver\n"
+		"  -o FILE      capture the WMI calls of the run to FILE\n"
+		"  -n COUNT     generate COUNT settings instead (default 150)\n"
+		"  -q US        latency of each WMI query\n"
+		"  -m US        latency of each WMI method call\n"
+		"  -i COUNT     operations per workload (default 1000)\n"
+		"  -e COUNT     probes for enumerate and snapshot, and resumes\n"
+		"               (default 20)\n"
+		"  -b COUNT     settings per batch (default 8)\n"
+		"  -t COUNT     most reader threads for stress (default 4)\n"
+		"  -p NAME=VAL  set a module parameter, like duplicate_call=0\n"
+		"  -P PWD       supervisor password to authenticate with\n"
+		"  -v           show driver messages, twice for debug\n"
+		"workloads: enumerate snapshot show set batch opcode names vec\n"
+		"           async watch admin resume stress\n"
+		"(default: all of them)\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const all[] = {
+		"enumerate", "snapshot", "show", "set", "batch", "opcode",
+		"names", "vec", "async", "watch", "admin", "resume", "stress",
+	};
+	const char *script = NULL, *trace = NULL, *capture = NULL;
+	char *eq;
+	int count = 150;
+	int opt, i, ret;
+
+	while ((opt = getopt(argc, argv, "f:r:o:n:q:m:i:e:b:t:p:P:vh")) != -1) {
+		switch (opt) {
+		case 'f':
+			script = optarg;
+			break;
+		case 'r':
+			trace = optarg;
+			break;
+		case 'o':
+			capture = optarg;
+			/* From module load on, to record the first scan */
+			kshim_param_set("capture", "65536");
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'q':
+			fake_bios_set_query_latency(atoi(optarg));
+			break;
+		case 'm':
+			fake_bios_set_method_latency(atoi(optarg));
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'e':
+			probes = atoi(optarg);
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'p':
+			eq = strchr(optarg, '=');
+			if (!eq)
+				usage(argv[0]);
+			*eq = '\0';
+			if (kshim_param_set(optarg, eq + 1)) {
+				fprintf(stderr, "bad parameter %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'P':
+			password = optarg;
+			break;
+		case 'v':
+			kshim_loglevel++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations < 1 || probes < 1 || batch_size < 1 || max_threads < 1)
+		usage(argv[0]);
+	for (i = optind; i < argc; i++) {
+		if (!bench_selected(argv[i], all, ARRAY_SIZE(all)))
+			usage(argv[0]);
+	}
+
+	if (script) {
+		ret = fake_bios_load(script);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", script, strerror(-ret));
+			return 1;
+		}
+	} else if (trace) {
+		ret = fake_bios_replay(trace);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", trace, strerror(-ret));
+			return 1;
+		}
+	} else {
+		fake_bios_generate(count);
+	}
+
+	kshim_init();
+	ret = kshim_module_init();
+	if (ret) {
+		fprintf(stderr, "module init failed: %s\n", strerror(-ret));
+		return 1;
+	}
+	bench_probe();
+	bench_discover();
+	bench_budgets();
+
+	printf("%d settings, %d with a plain choice list\n\n", nsettings,
+	       ntoggles);
+	printf("%-14s %8s %12s %10s %10s %10s\n", "workload", "ops",
+	       "ops/sec", "queries/op", "methods/op", "allocs/op");
+
+	for (i = 0; i < ARRAY_SIZE(all); i++) {
+		if (optind < argc &&
+		    !bench_selected(all[i], (const char * const *)argv + optind,
+				    argc - optind))
+			continue;
+		if (!strcmp(all[i], "enumerate")) {
+			bench_probes("enumerate", fake_bios_slots(), 0);
+			bench_probe();
+		} else if (!strcmp(all[i], "snapshot")) {
+			bench_snapshot();
+		} else if (!strcmp(all[i], "show")) {
+			bench_show_all();
+		} else if (!strcmp(all[i], "set")) {
+			bench_set();
+		} else if (!strcmp(all[i], "batch")) {
+			bench_batch();
+		} else if (!strcmp(all[i], "opcode")) {
+			bench_opcode();
+		} else if (!strcmp(all[i], "names")) {
+			bench_names();
+		} else if (!strcmp(all[i], "vec")) {
+			bench_vec();
+		} else if (!strcmp(all[i], "async")) {
+			bench_async_all();
+		} else if (!strcmp(all[i], "watch")) {
+			bench_watch();
+		} else if (!strcmp(all[i], "admin")) {
+			bench_admin();
+		} else if (!strcmp(all[i], "resume")) {
+			bench_resume();
+		} else if (!strcmp(all[i], "stress")) {
+			bench_stress();
+		}
+	}
+
+	if (capture)
+		bench_save_capture(capture);
+	kshim_module_exit();
+	kshim_exit();
+	fake_bios_free();
+	free(settings);
+	free(toggles);
+	return failures ? 1 : 0;
+}
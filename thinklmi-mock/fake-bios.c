@@ -0,0 +1,879 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * An in-memory Lenovo BIOS behind the WMI interface the driver uses.
+ *
+ * Settings are read with Lenovo_BiosSetting queries, changed with
+ * Lenovo_SetBiosSetting and only take effect on Lenovo_SaveBiosSettings,
+ * as on real machines. Each call can be given a latency, and the BIOS
+ * lock is held for it, as ACPI runs one method at a time. The settings
+ * and latencies can also be taken from a trace captured on a real
+ * machine.
+ */
+
+#include <ctype.h>
+#include <time.h>
+
+#include <kshim.h>
+#include "mock.h"
+
+#define FAKE_BIOS_MAX_SLOTS	255 /* Instance counts are a u8 */
+#define FAKE_BIOS_MAXLEN	512
+
+struct fake_bios_class_info {
+	const char *name;
+	const char *guid;
+	bool query;	/* A data block rather than a method */
+};
+
+static const struct fake_bios_class_info fake_bios_info[FAKE_BIOS_CLASSES] = {
+	[FAKE_BIOS_SETTING] = { "bios_setting",
+		"51F5230E-9677-46CD-A1CF-C0B23EE34DB7", true },
+	[FAKE_SET_BIOS_SETTINGS] = { "set_bios_settings",
+		"98479A64-33F5-4E33-A707-8E251EBBC3A1" },
+	[FAKE_SAVE_BIOS_SETTINGS] = { "save_bios_settings",
+		"6A4B54EF-A5ED-4D33-9455-B0D9B48DF4B3" },
+	[FAKE_DISCARD_BIOS_SETTINGS] = { "discard_bios_settings",
+		"74F1EBB6-927A-4C7D-95DF-698E21E80EB5" },
+	[FAKE_LOAD_DEFAULT_SETTINGS] = { "load_default_settings",
+		"7EEF04FF-4328-447C-B5BB-D449925D538D" },
+	[FAKE_BIOS_PASSWORD_SETTINGS] = { "bios_password_settings",
+		"8ADB159E-1E32-455C-BC93-308A7ED98246", true },
+	[FAKE_SET_BIOS_PASSWORD] = { "set_bios_password",
+		"2651D9FD-911C-4B69-B94E-D0DED5963BD7" },
+	[FAKE_GET_BIOS_SELECTIONS] = { "get_bios_selections",
+		"7364651A-132F-4FE7-ADAA-40C6C7EE2E3B" },
+	[FAKE_PLATFORM_SETTING] = { "platform_setting",
+		"7430019A-DCE9-4548-BAB0-9FDE0935CAFF", true },
+	[FAKE_SET_PLATFORM_SETTINGS] = { "set_platform_settings",
+		"7FF47003-3B6C-4E5E-A227-E979824A85D1" },
+	[FAKE_LMIOPCODE] = { "lmiopcode",
+		"DFDDEF2C-57D4-48CE-B196-0FB787D90836" },
+};
+
+/* One instance of Lenovo_BiosSetting; an empty slot has no name */
+struct fake_bios_setting {
+	char *name;
+	char *value;	/* Saved value */
+	char *pending;	/* Set but not saved yet, or NULL */
+	char *def;	/* Value restored by load default */
+	char *choices;
+};
+
+static struct {
+	pthread_mutex_t lock;	/* Held for the whole of each call */
+	struct fake_bios_setting slots[FAKE_BIOS_MAX_SLOTS];
+	int nslots;
+	bool missing[FAKE_BIOS_CLASSES];
+	unsigned int latency_us[FAKE_BIOS_CLASSES];
+	/* Latencies from a trace, used in turn instead of latency_us */
+	unsigned int *replay_us[FAKE_BIOS_CLASSES];
+	size_t replay_len[FAKE_BIOS_CLASSES];
+	size_t replay_next[FAKE_BIOS_CLASSES];
+	unsigned long calls[FAKE_BIOS_CLASSES];
+	char password[FAKE_BIOS_MAXLEN];	/* Supervisor, "" if none */
+	char bios_version[64];
+} fake_bios = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.bios_version = "N2HET99W (1.99)",
+};
+
+const char *fake_bios_class_name(enum fake_bios_class cls)
+{
+	return fake_bios_info[cls].name;
+}
+
+bool fake_bios_has(enum fake_bios_class cls)
+{
+	return !fake_bios.missing[cls];
+}
+
+static int fake_bios_class_of(const char *guid)
+{
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		if (!strcasecmp(fake_bios_info[i].guid, guid))
+			return fake_bios.missing[i] ? -1 : i;
+	}
+	return -1;
+}
+
+static int fake_bios_class_named(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		if (!strcmp(fake_bios_info[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+static char *fake_bios_strdup(const char *s)
+{
+	char *p = strdup(s);
+
+	if (!p)
+		abort();
+	return p;
+}
+
+static void fake_bios_clear_slot(struct fake_bios_setting *slot)
+{
+	free(slot->name);
+	free(slot->value);
+	free(slot->pending);
+	free(slot->def);
+	free(slot->choices);
+	memset(slot, 0, sizeof(*slot));
+}
+
+void fake_bios_free(void)
+{
+	int i;
+
+	pthread_mutex_lock(&fake_bios.lock);
+	for (i = 0; i < fake_bios.nslots; i++)
+		fake_bios_clear_slot(&fake_bios.slots[i]);
+	fake_bios.nslots = 0;
+	fake_bios.password[0] = '\0';
+	memset(fake_bios.missing, 0, sizeof(fake_bios.missing));
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		free(fake_bios.replay_us[i]);
+		fake_bios.replay_us[i] = NULL;
+		fake_bios.replay_len[i] = 0;
+		fake_bios.replay_next[i] = 0;
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+}
+
+static int fake_bios_add(const char *name, const char *value,
+			 const char *choices)
+{
+	struct fake_bios_setting *slot;
+
+	if (fake_bios.nslots == FAKE_BIOS_MAX_SLOTS)
+		return -ENOSPC;
+	slot = &fake_bios.slots[fake_bios.nslots++];
+	if (!name)
+		return 0;
+	slot->name = fake_bios_strdup(name);
+	slot->value = fake_bios_strdup(value);
+	slot->def = fake_bios_strdup(value);
+	slot->choices = fake_bios_strdup(choices);
+	return 0;
+}
+
+static struct fake_bios_setting *fake_bios_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < fake_bios.nslots; i++) {
+		if (fake_bios.slots[i].name &&
+		    !strcmp(fake_bios.slots[i].name, name))
+			return &fake_bios.slots[i];
+	}
+	return NULL;
+}
+
+static void fake_bios_publish_dmi(void)
+{
+	kshim_dmi_set(DMI_BIOS_VERSION, fake_bios.bios_version);
+}
+
+/*
+ * A machine with count settings shaped like a ThinkPad's: mostly
+ * Enable/Disable switches sharing a few choice lists, a name with a '/',
+ * a boot order and a value range.
+ */
+void fake_bios_generate(int count)
+{
+	static const char * const lists[] = {
+		"Disable,Enable",
+		"Disable,Enable",
+		"Enable,Disable,Auto",
+		"Off,On",
+		"Disable,Enable,Software Control",
+	};
+	const char *list;
+	char name[64], value[64];
+	size_t len;
+	int i;
+
+	fake_bios_free();
+	pthread_mutex_lock(&fake_bios.lock);
+	for (i = 0; i < count && i < FAKE_BIOS_MAX_SLOTS; i++) {
+		if (i == 0) {
+			fake_bios_add("Boot/Order", "NVMe0:USBHDD:PXEBOOT",
+				      "NVMe0:USBHDD:USBCD:PXEBOOT:HDD0");
+		} else if (i == 1) {
+			fake_bios_add("BacklightTimeout", "30", "[5-300]");
+		} else if (i % 37 == 36) {
+			fake_bios_add(NULL, NULL, NULL);
+		} else {
+			/* The first or second choice, alternately */
+			list = lists[i % ARRAY_SIZE(lists)];
+			len = strcspn(list, ",");
+			if (i % 2) {
+				list += len + 1;
+				len = strcspn(list, ",");
+			}
+			snprintf(value, sizeof(value), "%.*s", (int)len, list);
+			snprintf(name, sizeof(name), "Setting%03d", i);
+			fake_bios_add(name, value, lists[i % ARRAY_SIZE(lists)]);
+		}
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+	fake_bios_publish_dmi();
+}
+
+static char *fake_bios_token(char **s)
+{
+	char *start;
+
+	while (isspace((unsigned char)**s))
+		(*s)++;
+	if (!**s)
+		return NULL;
+	start = *s;
+	while (**s && !isspace((unsigned char)**s))
+		(*s)++;
+	if (**s)
+		*(*s)++ = '\0';
+	return start;
+}
+
+static int fake_bios_set_latency_named(const char *name, unsigned int us)
+{
+	int cls;
+
+	if (!strcmp(name, "query"))
+		fake_bios_set_query_latency(us);
+	else if (!strcmp(name, "method"))
+		fake_bios_set_method_latency(us);
+	else if ((cls = fake_bios_class_named(name)) >= 0)
+		fake_bios_set_latency(cls, us);
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/* Apply one script line, see README.md for the syntax */
+static int fake_bios_script_line(char *line)
+{
+	char *cmd, *name, *value, *choices, *rest;
+	int cls;
+
+	cmd = fake_bios_token(&line);
+	if (!cmd || *cmd == '#')
+		return 0;
+
+	if (!strcmp(cmd, "setting")) {
+		name = fake_bios_token(&line);
+		value = fake_bios_token(&line);
+		choices = fake_bios_token(&line);
+		if (!name || !value)
+			return -EINVAL;
+		return fake_bios_add(name, value,
+				     choices && strcmp(choices, "-") ?
+				     choices : "");
+	}
+	if (!strcmp(cmd, "empty"))
+		return fake_bios_add(NULL, NULL, NULL);
+	if (!strcmp(cmd, "latency")) {
+		name = fake_bios_token(&line);
+		value = fake_bios_token(&line);
+		if (!name || !value)
+			return -EINVAL;
+		return fake_bios_set_latency_named(name, strtoul(value, NULL,
+								 0));
+	}
+	if (!strcmp(cmd, "missing")) {
+		name = fake_bios_token(&line);
+		cls = name ? fake_bios_class_named(name) : -1;
+		if (cls < 0)
+			return -EINVAL;
+		fake_bios.missing[cls] = true;
+		return 0;
+	}
+	if (!strcmp(cmd, "password")) {
+		value = fake_bios_token(&line);
+		if (!value)
+			return -EINVAL;
+		strscpy(fake_bios.password, value, sizeof(fake_bios.password));
+		return 0;
+	}
+	if (!strcmp(cmd, "bios_version")) {
+		/* The rest of the line, spaces included */
+		while (isspace((unsigned char)*line))
+			line++;
+		rest = line + strcspn(line, "\r\n");
+		*rest = '\0';
+		strscpy(fake_bios.bios_version, line,
+			sizeof(fake_bios.bios_version));
+		return 0;
+	}
+	return -EINVAL;
+}
+
+int fake_bios_load(const char *path)
+{
+	char line[FAKE_BIOS_MAXLEN * 2];
+	int lineno = 0, ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	fake_bios_free();
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		ret = fake_bios_script_line(line);
+		if (ret) {
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			break;
+		}
+	}
+	fclose(fp);
+	fake_bios_publish_dmi();
+	return ret;
+}
+
+/* Undo the octal escapes of the driver's capture, in place */
+static void fake_bios_unescape(char *s)
+{
+	char *out = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*out++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 |
+				 (s[3] - '0');
+			s += 4;
+		} else {
+			*out++ = *s++;
+		}
+	}
+	*out = '\0';
+}
+
+/* Split a capture line into its tab separated fields */
+static int fake_bios_fields(char *line, char **fields, int max)
+{
+	int n = 0;
+
+	line[strcspn(line, "\n")] = '\0';
+	while (n < max && line)
+		fields[n++] = strsep(&line, "\t");
+	return line ? -1 : n;
+}
+
+static void fake_bios_replay_latency(int cls, unsigned int us)
+{
+	unsigned int *p;
+	size_t len = fake_bios.replay_len[cls];
+
+	/* Grow in powers of two */
+	if (!(len & (len - 1))) {
+		p = realloc(fake_bios.replay_us[cls],
+			    (len ? len * 2 : 1) * sizeof(*p));
+		if (!p)
+			abort();
+		fake_bios.replay_us[cls] = p;
+	}
+	fake_bios.replay_us[cls][fake_bios.replay_len[cls]++] = us;
+}
+
+/*
+ * Take the settings from the first reply for each instance and the
+ * choices from the first reply for each name. A failed call still gives
+ * its latency.
+ */
+static int fake_bios_replay_call(char **f)
+{
+	struct fake_bios_setting *slot;
+	unsigned long calls, status;
+	long instance;
+	char *comma;
+	int cls, i;
+
+	cls = fake_bios_class_named(f[3]);
+	if (cls < 0) {
+		for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+			if (!strcasecmp(fake_bios_info[i].guid, f[3]))
+				cls = i;
+		}
+	}
+	if (cls < 0)
+		return -EINVAL;
+	calls = strtoul(f[2], NULL, 0);
+	if (!calls)
+		return -EINVAL;
+	instance = strtol(f[4], NULL, 0);
+	status = strtoul(f[5], NULL, 0);
+	fake_bios_unescape(f[6]);
+	fake_bios_unescape(f[7]);
+
+	/* A method evaluated twice took the latency of both calls */
+	for (i = 0; i < calls; i++)
+		fake_bios_replay_latency(cls, strtoul(f[1], NULL, 0) / calls);
+	if (status != AE_OK)
+		return 0;
+
+	if (cls == FAKE_BIOS_SETTING && instance >= 0 &&
+	    instance < FAKE_BIOS_MAX_SLOTS) {
+		while (fake_bios.nslots <= instance)
+			fake_bios_add(NULL, NULL, NULL);
+		slot = &fake_bios.slots[instance];
+		comma = strchr(f[7], ',');
+		if (slot->name || !comma)
+			return 0;
+		*comma = '\0';
+		fake_bios_clear_slot(slot);
+		slot->name = fake_bios_strdup(f[7]);
+		slot->value = fake_bios_strdup(comma + 1);
+		slot->def = fake_bios_strdup(comma + 1);
+		slot->choices = fake_bios_strdup("");
+	} else if (cls == FAKE_GET_BIOS_SELECTIONS) {
+		slot = fake_bios_find(f[6]);
+		if (slot && !*slot->choices) {
+			free(slot->choices);
+			slot->choices = fake_bios_strdup(f[7]);
+		}
+	}
+	return 0;
+}
+
+/* Load a trace exported from the capture file in the driver's debugfs */
+int fake_bios_replay(const char *path)
+{
+	static const char version[] = "# bios_version: ";
+	char line[FAKE_BIOS_MAXLEN * 4], *f[8];
+	int lineno = 0, ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	fake_bios_free();
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (!strncmp(line, version, sizeof(version) - 1)) {
+			line[strcspn(line, "\n")] = '\0';
+			strscpy(fake_bios.bios_version,
+				line + sizeof(version) - 1,
+				sizeof(fake_bios.bios_version));
+			continue;
+		}
+		if (line[0] == '#')
+			continue;
+		if (fake_bios_fields(line, f, ARRAY_SIZE(f)) !=
+		    ARRAY_SIZE(f)) {
+			ret = -EINVAL;
+		} else {
+			ret = fake_bios_replay_call(f);
+		}
+		if (ret) {
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			break;
+		}
+	}
+	fclose(fp);
+	fake_bios_publish_dmi();
+	return ret;
+}
+
+void fake_bios_set_latency(enum fake_bios_class cls, unsigned int us)
+{
+	fake_bios.latency_us[cls] = us;
+}
+
+void fake_bios_set_query_latency(unsigned int us)
+{
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		if (fake_bios_info[i].query)
+			fake_bios.latency_us[i] = us;
+	}
+}
+
+void fake_bios_set_method_latency(unsigned int us)
+{
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		if (!fake_bios_info[i].query)
+			fake_bios.latency_us[i] = us;
+	}
+}
+
+int fake_bios_slots(void)
+{
+	return fake_bios.nslots;
+}
+
+const char *fake_bios_name(int slot)
+{
+	return slot < fake_bios.nslots ? fake_bios.slots[slot].name : NULL;
+}
+
+const char *fake_bios_value(int slot)
+{
+	return slot < fake_bios.nslots ? fake_bios.slots[slot].value : NULL;
+}
+
+const char *fake_bios_choices(int slot)
+{
+	return slot < fake_bios.nslots ? fake_bios.slots[slot].choices : NULL;
+}
+
+void fake_bios_reset_calls(void)
+{
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++)
+		__atomic_store_n(&fake_bios.calls[i], 0, __ATOMIC_RELAXED);
+}
+
+unsigned long fake_bios_calls(enum fake_bios_class cls)
+{
+	return __atomic_load_n(&fake_bios.calls[cls], __ATOMIC_RELAXED);
+}
+
+static unsigned long fake_bios_sum_calls(bool query)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < FAKE_BIOS_CLASSES; i++) {
+		if (fake_bios_info[i].query == query)
+			sum += fake_bios_calls(i);
+	}
+	return sum;
+}
+
+unsigned long fake_bios_queries(void)
+{
+	return fake_bios_sum_calls(true);
+}
+
+unsigned long fake_bios_methods(void)
+{
+	return fake_bios_sum_calls(false);
+}
+
+/* Called with the BIOS lock held, which the delay is spent under */
+static void fake_bios_enter(int cls)
+{
+	struct timespec ts;
+	unsigned int us = fake_bios.latency_us[cls];
+
+	if (fake_bios.replay_len[cls])
+		us = fake_bios.replay_us[cls][fake_bios.replay_next[cls]++ %
+					      fake_bios.replay_len[cls]];
+	__atomic_fetch_add(&fake_bios.calls[cls], 1, __ATOMIC_RELAXED);
+	if (!us)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000L;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static acpi_status fake_bios_reply(struct acpi_buffer *out, const char *str)
+{
+	union acpi_object *obj;
+	size_t len = strlen(str);
+
+	obj = malloc(sizeof(*obj) + len + 1);
+	if (!obj)
+		return AE_NO_MEMORY;
+	obj->string.type = ACPI_TYPE_STRING;
+	obj->string.length = len;
+	obj->string.pointer = (char *)(obj + 1);
+	memcpy(obj->string.pointer, str, len + 1);
+	out->pointer = obj;
+	out->length = sizeof(*obj) + len + 1;
+	return AE_OK;
+}
+
+/* Plain lists are enforced; boot orders and ranges are taken as given */
+static bool fake_bios_allowed(const char *choices, const char *value)
+{
+	size_t len = strlen(value), n;
+	const char *p = choices;
+
+	if (!*choices || strpbrk(choices, ":["))
+		return true;
+	while (*p) {
+		n = strcspn(p, ",");
+		if (n == len && !strncmp(p, value, len))
+			return true;
+		p += n;
+		if (*p)
+			p++;
+	}
+	return false;
+}
+
+int fake_bios_rename(int slot, const char *name)
+{
+	struct fake_bios_setting *s;
+	int ret = -EINVAL;
+
+	pthread_mutex_lock(&fake_bios.lock);
+	s = slot < fake_bios.nslots ? &fake_bios.slots[slot] : NULL;
+	if (s && s->name) {
+		free(s->name);
+		s->name = fake_bios_strdup(name);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+	return ret;
+}
+
+int fake_bios_change(int slot, const char *value)
+{
+	struct fake_bios_setting *s;
+	int ret = -EINVAL;
+
+	pthread_mutex_lock(&fake_bios.lock);
+	s = slot < fake_bios.nslots ? &fake_bios.slots[slot] : NULL;
+	if (s && s->name && fake_bios_allowed(s->choices, value)) {
+		free(s->value);
+		s->value = fake_bios_strdup(value);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+	return ret;
+}
+
+void fake_bios_discard(void)
+{
+	int i;
+
+	pthread_mutex_lock(&fake_bios.lock);
+	for (i = 0; i < fake_bios.nslots; i++) {
+		free(fake_bios.slots[i].pending);
+		fake_bios.slots[i].pending = NULL;
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+}
+
+/*
+ * Split a method argument on ',' after dropping the final ';'. Returns
+ * the number of fields.
+ */
+static int fake_bios_split(char *arg, char **fields, int max)
+{
+	int n = 0;
+
+	arg[strcspn(arg, ";")] = '\0';
+	while (n < max && arg)
+		fields[n++] = strsep(&arg, ",");
+	return n;
+}
+
+static bool fake_bios_auth(const char *password)
+{
+	return !*fake_bios.password ||
+	       (password && !strcmp(password, fake_bios.password));
+}
+
+static const char *fake_bios_set(char *arg)
+{
+	struct fake_bios_setting *slot;
+	char *f[5];
+	int n;
+
+	n = fake_bios_split(arg, f, ARRAY_SIZE(f));
+	if (n < 2)
+		return "Invalid";
+	slot = fake_bios_find(f[0]);
+	if (!slot || !fake_bios_allowed(slot->choices, f[1]))
+		return "Invalid";
+	if (!fake_bios_auth(n > 2 ? f[2] : NULL))
+		return "Access Denied";
+	free(slot->pending);
+	slot->pending = fake_bios_strdup(f[1]);
+	return "Success";
+}
+
+static const char *fake_bios_commit(char *arg, bool save)
+{
+	struct fake_bios_setting *slot;
+	char *f[3];
+	int i, n;
+
+	n = fake_bios_split(arg, f, ARRAY_SIZE(f));
+	if (!fake_bios_auth(n && *f[0] ? f[0] : NULL))
+		return "Access Denied";
+	for (i = 0; i < fake_bios.nslots; i++) {
+		slot = &fake_bios.slots[i];
+		if (!slot->pending)
+			continue;
+		if (save) {
+			free(slot->value);
+			slot->value = slot->pending;
+		} else {
+			free(slot->pending);
+		}
+		slot->pending = NULL;
+	}
+	return "Success";
+}
+
+static const char *fake_bios_load_default(char *arg)
+{
+	struct fake_bios_setting *slot;
+	char *f[3];
+	int i, n;
+
+	n = fake_bios_split(arg, f, ARRAY_SIZE(f));
+	if (!fake_bios_auth(n && *f[0] ? f[0] : NULL))
+		return "Access Denied";
+	for (i = 0; i < fake_bios.nslots; i++) {
+		slot = &fake_bios.slots[i];
+		if (!slot->name)
+			continue;
+		free(slot->pending);
+		slot->pending = fake_bios_strdup(slot->def);
+	}
+	return "Success";
+}
+
+/* "Type,Current,New,Encoding,KbdLang;" changes the supervisor password */
+static const char *fake_bios_set_password(char *arg)
+{
+	char *f[5];
+	int n;
+
+	n = fake_bios_split(arg, f, ARRAY_SIZE(f));
+	if (n < 3)
+		return "Invalid";
+	if (strcmp(f[0], "pap"))
+		return "Success";
+	if (!fake_bios_auth(f[1]))
+		return "Access Denied";
+	strscpy(fake_bios.password, f[2], sizeof(fake_bios.password));
+	return "Success";
+}
+
+/*
+ * "WmiOpcode<Opcode>:<Arg>;" is checked for its form, and the
+ * supervisor password given with PasswordAdmin. The argument may be
+ * empty, but only PasswordSetUpdate is sent without one, as
+ * "WmiOpcodePasswordSetUpdate;". Opcodes have no effect.
+ */
+static const char *fake_bios_opcode(char *arg)
+{
+	static const char prefix[] = "WmiOpcode";
+	size_t len = strlen(arg);
+	char *colon;
+
+	if (strncmp(arg, prefix, sizeof(prefix) - 1) || !len ||
+	    arg[len - 1] != ';' || strchr(arg, ';') != arg + len - 1)
+		return "Invalid";
+	arg[len - 1] = '\0';
+	arg += sizeof(prefix) - 1;
+	colon = strchr(arg, ':');
+	if (colon)
+		*colon++ = '\0';
+	if (!*arg || !colon != !strcmp(arg, "PasswordSetUpdate"))
+		return "Invalid";
+	if (!strcmp(arg, "PasswordAdmin") && !fake_bios_auth(colon))
+		return "Access Denied";
+	return "Success";
+}
+
+acpi_status wmi_query_block(const char *guid, u8 instance,
+			    struct acpi_buffer *out)
+{
+	struct fake_bios_setting *slot;
+	char buf[FAKE_BIOS_MAXLEN * 2];
+	acpi_status status = AE_OK;
+	int cls = fake_bios_class_of(guid);
+
+	if (cls < 0 || !fake_bios_info[cls].query)
+		return AE_NOT_FOUND;
+
+	pthread_mutex_lock(&fake_bios.lock);
+	fake_bios_enter(cls);
+	if (cls != FAKE_BIOS_SETTING) {
+		/* Password settings and the platform block aren't modelled */
+		status = fake_bios_reply(out, "");
+	} else if (instance >= fake_bios.nslots) {
+		status = AE_BAD_PARAMETER;
+	} else {
+		slot = &fake_bios.slots[instance];
+		if (slot->name)
+			snprintf(buf, sizeof(buf), "%s,%s", slot->name,
+				 slot->value);
+		else
+			buf[0] = '\0';
+		status = fake_bios_reply(out, buf);
+	}
+	pthread_mutex_unlock(&fake_bios.lock);
+	return status;
+}
+
+acpi_status wmi_evaluate_method(const char *guid, u8 instance, u32 method_id,
+				const struct acpi_buffer *in,
+				struct acpi_buffer *out)
+{
+	struct fake_bios_setting *slot;
+	char arg[FAKE_BIOS_MAXLEN * 2];
+	const char *reply = "Success";
+	acpi_status status;
+	int cls = fake_bios_class_of(guid);
+
+	if (cls < 0 || fake_bios_info[cls].query)
+		return AE_NOT_FOUND;
+	if (!in || in->length >= sizeof(arg))
+		return AE_BAD_PARAMETER;
+	memcpy(arg, in->pointer, in->length);
+	arg[in->length] = '\0';
+
+	pthread_mutex_lock(&fake_bios.lock);
+	fake_bios_enter(cls);
+	switch (cls) {
+	case FAKE_SET_BIOS_SETTINGS:
+		reply = fake_bios_set(arg);
+		break;
+	case FAKE_SAVE_BIOS_SETTINGS:
+		reply = fake_bios_commit(arg, true);
+		break;
+	case FAKE_DISCARD_BIOS_SETTINGS:
+		reply = fake_bios_commit(arg, false);
+		break;
+	case FAKE_LOAD_DEFAULT_SETTINGS:
+		reply = fake_bios_load_default(arg);
+		break;
+	case FAKE_SET_BIOS_PASSWORD:
+		reply = fake_bios_set_password(arg);
+		break;
+	case FAKE_GET_BIOS_SELECTIONS:
+		slot = fake_bios_find(arg);
+		reply = slot ? slot->choices : "";
+		break;
+	case FAKE_LMIOPCODE:
+		reply = fake_bios_opcode(arg);
+		break;
+	}
+	status = fake_bios_reply(out, reply);
+	pthread_mutex_unlock(&fake_bios.lock);
+	return status;
+}
+
+bool wmi_has_guid(const char *guid)
+{
+	return fake_bios_class_of(guid) >= 0;
+}
+
+u8 wmidev_instance_count(struct wmi_device *wdev)
+{
+	return fake_bios.nslots;
+}
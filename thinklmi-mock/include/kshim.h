@@ -0,0 +1,733 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Userspace stand-ins for the kernel interfaces used by think-lmi.c, so
+ * the driver can run as an ordinary program against the fake BIOS in
+ * fake-bios.c. Every <linux/...> header the driver includes resolves to
+ * this file. Only what the driver uses is provided, with the kernel's
+ * semantics where they matter to it: locks are real pthread locks and
+ * workqueues run on their own threads.
+ */
+
+#ifndef _KSHIM_H_
+#define _KSHIM_H_
+
+#include <asm-generic/ioctl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Types */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int32_t s32;
+typedef long long s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s32 __s32;
+typedef s64 __s64;
+typedef u32 __le32;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+typedef unsigned int __poll_t;
+
+#define __user
+#define __init
+#define __exit
+#define __maybe_unused	__attribute__((unused))
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define U8_MAX		0xff
+#define BIT(n)		(1UL << (n))
+#define ERESTARTSYS	512
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define struct_size(p, member, n) \
+	(sizeof(*(p)) + sizeof(*(p)->member) * (n))
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)	min((t)(a), (t)(b))
+#define max_t(t, a, b)	max((t)(a), (t)(b))
+#define max3(a, b, c)	max(max(a, b), c)
+
+#define READ_ONCE(x)	(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+
+#define le32_to_cpu(x)	((u32)(x))
+#define cpu_to_le32(x)	((__le32)(x))
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/* Error pointers */
+
+#define MAX_ERRNO	4095
+#define IS_ERR_VALUE(x)	((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE((unsigned long)ptr);
+}
+
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR(ptr);
+}
+
+static inline int PTR_ERR_OR_ZERO(const void *ptr)
+{
+	return IS_ERR(ptr) ? PTR_ERR(ptr) : 0;
+}
+
+/* printk */
+
+enum {
+	KSHIM_LOG_ERR,
+	KSHIM_LOG_WARN,
+	KSHIM_LOG_INFO,
+	KSHIM_LOG_DEBUG,
+};
+
+extern int kshim_loglevel;
+
+void kshim_printk(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+
+#define pr_err(fmt, ...) \
+	kshim_printk(KSHIM_LOG_ERR, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...) \
+	kshim_printk(KSHIM_LOG_WARN, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...) \
+	kshim_printk(KSHIM_LOG_INFO, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...) \
+	kshim_printk(KSHIM_LOG_DEBUG, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn_once(fmt, ...) ({				\
+	static bool __warned;					\
+	if (!__atomic_exchange_n(&__warned, true, __ATOMIC_RELAXED)) \
+		pr_warn(fmt, ##__VA_ARGS__);			\
+})
+
+/* Modules */
+
+struct module;
+#define THIS_MODULE	((struct module *)NULL)
+#define KBUILD_MODNAME	"think_lmi"
+
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_ALIAS(x)
+#define MODULE_PARM_DESC(name, desc)
+
+void kshim_param_register(const char *name, const char *type, void *value);
+
+/* Parameters register themselves so the harness can set them by name */
+#define module_param(name, type, perm)					\
+	static void __attribute__((constructor)) __kshim_param_##name(void) \
+	{								\
+		kshim_param_register(#name, #type, &name);		\
+	}
+
+#define module_init(fn)	int kshim_module_init(void) { return fn(); }
+#define module_exit(fn)	void kshim_module_exit(void) { fn(); }
+
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 8, 0)
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+
+/* Memory */
+
+#define GFP_KERNEL	0u
+#define __GFP_ZERO	0x100u
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+void *kmalloc_array(size_t n, size_t size, gfp_t flags);
+void *krealloc(const void *p, size_t size, gfp_t flags);
+void kfree(const void *p);
+void *kvmalloc_array(size_t n, size_t size, gfp_t flags);
+void *kvzalloc(size_t size, gfp_t flags);
+void kvfree(const void *p);
+char *kstrdup(const char *s, gfp_t flags);
+void *kmemdup(const void *src, size_t len, gfp_t flags);
+
+static inline void memzero_explicit(void *s, size_t count)
+{
+	explicit_bzero(s, count);
+}
+
+/* Strings */
+
+ssize_t strscpy(char *dest, const char *src, size_t count);
+char *strreplace(char *s, char old, char new);
+char *strnchr(const char *s, size_t count, int c);
+
+/* User memory is ordinary memory here */
+
+static inline unsigned long copy_to_user(void *to, const void *from,
+					 unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from,
+					   unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+long strncpy_from_user(char *dst, const char *src, long count);
+void *memdup_user(const void *src, size_t len);
+void *memdup_user_nul(const void *src, size_t len);
+int kstrtouint_from_user(const char *s, size_t count, unsigned int base,
+			 unsigned int *res);
+
+/* Atomics */
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+typedef struct { long long counter; } atomic64_t;
+
+#define ATOMIC_INIT(i)	{ (i) }
+
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_add(i, v)	((void)__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_inc(v)		atomic_add(1, v)
+#define atomic_long_read(v)	atomic_read(v)
+#define atomic_long_inc(v)	atomic_inc(v)
+#define atomic64_read(v)	atomic_read(v)
+#define atomic64_add(i, v)	atomic_add(i, v)
+
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	__atomic_fetch_add(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref *kref,
+			   void (*release)(struct kref *kref))
+{
+	if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	release(kref);
+	return 1;
+}
+
+/* Locks */
+
+struct mutex {
+	pthread_mutex_t lock;
+};
+
+#define DEFINE_MUTEX(m)		struct mutex m = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(m)		pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_lock(m)		pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m)		pthread_mutex_unlock(&(m)->lock)
+#define mutex_lock_interruptible(m) (mutex_lock(m), 0)
+
+typedef struct {
+	pthread_mutex_t lock;
+} spinlock_t;
+
+#define spin_lock_init(s)	pthread_mutex_init(&(s)->lock, NULL)
+#define spin_lock(s)		pthread_mutex_lock(&(s)->lock)
+#define spin_unlock(s)		pthread_mutex_unlock(&(s)->lock)
+
+struct rw_semaphore {
+	pthread_rwlock_t lock;
+};
+
+/* Writers are not starved by a stream of readers, as with rwsem */
+void init_rwsem(struct rw_semaphore *sem);
+#define down_read(s)		pthread_rwlock_rdlock(&(s)->lock)
+#define up_read(s)		pthread_rwlock_unlock(&(s)->lock)
+#define down_write(s)		pthread_rwlock_wrlock(&(s)->lock)
+#define up_write(s)		pthread_rwlock_unlock(&(s)->lock)
+
+/* Wait queues and completions */
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wait_queue_head_t;
+
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible(wait_queue_head_t *wq);
+
+/* Signals are never pending, so this only returns once condition is true */
+#define wait_event_interruptible(wq_head, condition) ({		\
+	pthread_mutex_lock(&(wq_head).lock);			\
+	while (!(condition))					\
+		pthread_cond_wait(&(wq_head).cond, &(wq_head).lock); \
+	pthread_mutex_unlock(&(wq_head).lock);			\
+	0;							\
+})
+
+struct completion {
+	wait_queue_head_t wait;
+	bool done;
+};
+
+void init_completion(struct completion *x);
+void complete_all(struct completion *x);
+bool completion_done(struct completion *x);
+void wait_for_completion(struct completion *x);
+#define wait_for_completion_interruptible(x) (wait_for_completion(x), 0)
+
+/* Lists */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define INIT_LIST_HEAD(l)	((l)->next = (l)->prev = (l))
+
+static inline void list_add_tail(struct list_head *entry,
+				 struct list_head *head)
+{
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return READ_ONCE(head->next) == head;
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry_or_null(head, type, member) \
+	(list_empty(head) ? NULL : list_entry((head)->next, type, member))
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+	     n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* Hash tables */
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+#define DECLARE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_BITS(name)	__builtin_ctz(ARRAY_SIZE(name))
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * 0x61C88647u) >> (32 - bits);
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	n->next = h->first;
+	if (h->first)
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!n->pprev)
+		return;
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) ({			\
+	typeof(ptr) ____ptr = (ptr);				\
+	____ptr ? container_of(____ptr, type, member) : NULL;	\
+})
+
+#define hash_init(table)	memset((table), 0, sizeof(table))
+#define hash_add(table, node, key) \
+	hlist_add_head(node, &(table)[hash_32(key, HASH_BITS(table))])
+#define hash_del(node)		hlist_del_init(node)
+#define hash_for_each_possible(table, obj, member, key)			\
+	for (obj = hlist_entry_safe((table)[hash_32(key, HASH_BITS(table))].first, \
+				    typeof(*(obj)), member);		\
+	     obj;							\
+	     obj = hlist_entry_safe((obj)->member.next, typeof(*(obj)), member))
+
+u32 full_name_hash(const void *salt, const char *name, unsigned int len);
+
+/* Time */
+
+typedef s64 ktime_t;
+
+ktime_t ktime_get(void);
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_to_ns(t)		(t)
+#define ktime_us_delta(a, b)	(((a) - (b)) / 1000)
+
+/* Workqueues */
+
+struct work_struct {
+	void (*func)(struct work_struct *work);
+	struct list_head entry;
+	bool pending;
+};
+
+struct workqueue_struct;
+
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_long_wq;
+extern struct workqueue_struct *system_unbound_wq;
+
+#define WQ_UNBOUND	(1 << 1)
+
+#define INIT_WORK(w, f) do {			\
+	(w)->func = (f);			\
+	(w)->pending = false;			\
+	INIT_LIST_HEAD(&(w)->entry);		\
+} while (0)
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+void flush_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool schedule_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+bool flush_work(struct work_struct *work);
+
+/* Files */
+
+struct inode;
+struct file;
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+
+struct file_operations {
+	struct module *owner;
+	loff_t (*llseek)(struct file *, loff_t, int);
+	ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char *, size_t, loff_t *);
+	__poll_t (*poll)(struct file *, poll_table *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	long (*compat_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	int (*fasync)(int, struct file *, int);
+};
+
+struct cdev {
+	const struct file_operations *ops;
+	dev_t dev;
+};
+
+struct inode {
+	struct cdev *i_cdev;
+	void *i_private;
+};
+
+struct file {
+	const struct file_operations *f_op;
+	unsigned int f_flags;
+	void *private_data;
+};
+
+int alloc_chrdev_region(dev_t *dev, unsigned int first, unsigned int count,
+			const char *name);
+void unregister_chrdev_region(dev_t dev, unsigned int count);
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+
+loff_t default_llseek(struct file *file, loff_t offset, int whence);
+ssize_t simple_read_from_buffer(void *to, size_t count, loff_t *ppos,
+				const void *from, size_t available);
+
+#ifndef EPOLLIN
+#define EPOLLIN		0x001
+#endif
+#ifndef EPOLLRDNORM
+#define EPOLLRDNORM	0x040
+#endif
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq,
+			     poll_table *p)
+{
+}
+
+struct fasync_struct;
+
+int fasync_helper(int fd, struct file *filp, int on,
+		  struct fasync_struct **fapp);
+void kill_fasync(struct fasync_struct **fp, int sig, int band);
+
+struct eventfd_ctx;
+
+struct eventfd_ctx *eventfd_ctx_fdget(int fd);
+void eventfd_ctx_put(struct eventfd_ctx *ctx);
+void eventfd_signal(struct eventfd_ctx *ctx);
+
+/* seq_file */
+
+struct seq_operations;
+
+struct seq_file {
+	char *buf;
+	size_t size;
+	size_t count;
+	bool filled;
+	const struct seq_operations *op;
+	int (*single_show)(struct seq_file *, void *);
+	void *private;
+};
+
+struct seq_operations {
+	void *(*start)(struct seq_file *m, loff_t *pos);
+	void (*stop)(struct seq_file *m, void *v);
+	void *(*next)(struct seq_file *m, void *v, loff_t *pos);
+	int (*show)(struct seq_file *m, void *v);
+};
+
+int seq_open(struct file *file, const struct seq_operations *op);
+ssize_t seq_read(struct file *file, char *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+int seq_release(struct inode *inode, struct file *file);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data);
+int single_release(struct inode *inode, struct file *file);
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void seq_puts(struct seq_file *m, const char *s);
+void seq_putc(struct seq_file *m, char c);
+/* Octal escapes for the characters in esc */
+void seq_escape(struct seq_file *m, const char *s, const char *esc);
+
+/* debugfs */
+
+struct dentry;
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+void debugfs_create_ulong(const char *name, umode_t mode,
+			  struct dentry *parent, unsigned long *value);
+void debugfs_create_u64(const char *name, umode_t mode,
+			struct dentry *parent, u64 *value);
+void debugfs_create_atomic_t(const char *name, umode_t mode,
+			     struct dentry *parent, atomic_t *value);
+void debugfs_remove_recursive(struct dentry *dentry);
+
+/* Devices */
+
+struct device {
+	void *driver_data;
+};
+
+struct class;
+struct dev_ext_attribute;
+
+static inline void dev_set_drvdata(struct device *dev, void *data)
+{
+	dev->driver_data = data;
+}
+
+static inline void *dev_get_drvdata(const struct device *dev)
+{
+	return dev->driver_data;
+}
+
+/* The owner argument was dropped in 6.4, accept either form */
+#define class_create(...)	kshim_class_create()
+struct class *kshim_class_create(void);
+void class_destroy(struct class *cls);
+struct device *device_create(struct class *cls, struct device *parent,
+			     dev_t devt, void *drvdata, const char *fmt, ...);
+void device_destroy(struct class *cls, dev_t devt);
+
+/* DMI */
+
+enum dmi_field {
+	DMI_NONE,
+	DMI_BIOS_VENDOR,
+	DMI_BIOS_VERSION,
+	DMI_BIOS_DATE,
+	DMI_SYS_VENDOR,
+	DMI_PRODUCT_NAME,
+	DMI_PRODUCT_VERSION,
+	DMI_STRING_MAX,
+};
+
+struct dmi_strmatch {
+	unsigned char slot;
+	char substr[79];
+};
+
+struct dmi_system_id {
+	int (*callback)(const struct dmi_system_id *);
+	const char *ident;
+	struct dmi_strmatch matches[4];
+	void *driver_data;
+};
+
+#define DMI_MATCH(a, b)	{ .slot = a, .substr = b }
+
+const struct dmi_system_id *dmi_first_match(const struct dmi_system_id *list);
+const char *dmi_get_system_info(int field);
+
+/* Firmware loading, from the directory the harness points at */
+
+struct firmware {
+	size_t size;
+	const u8 *data;
+};
+
+int request_firmware_direct(const struct firmware **fw, const char *name,
+			    struct device *device);
+void release_firmware(const struct firmware *fw);
+
+u32 crc32_le(u32 crc, const unsigned char *p, size_t len);
+
+/* ACPI and WMI, backed by the fake BIOS */
+
+typedef u32 acpi_status;
+typedef size_t acpi_size;
+
+#define AE_OK			0x0000
+#define AE_ERROR		0x0001
+#define AE_NOT_FOUND		0x0005
+#define AE_NO_MEMORY		0x0004
+#define AE_BAD_PARAMETER	0x1001
+#define ACPI_SUCCESS(s)		((s) == AE_OK)
+#define ACPI_FAILURE(s)		((s) != AE_OK)
+#define ACPI_ALLOCATE_BUFFER	((acpi_size)-1)
+#define ACPI_TYPE_STRING	0x02
+
+struct acpi_buffer {
+	acpi_size length;
+	void *pointer;
+};
+
+union acpi_object {
+	u32 type;
+	struct {
+		u32 type;
+		u32 length;
+		char *pointer;
+	} string;
+};
+
+struct wmi_device {
+	struct device dev;
+};
+
+struct wmi_device_id {
+	const char *guid_string;
+	const void *context;
+};
+
+/* Only system sleep is simulated, see kshim_wmi_resume() */
+struct dev_pm_ops {
+	int (*suspend)(struct device *dev);
+	int (*resume)(struct device *dev);
+};
+
+#define SIMPLE_DEV_PM_OPS(name, suspend_fn, resume_fn) \
+	const struct dev_pm_ops name = { \
+		.suspend = suspend_fn, \
+		.resume = resume_fn, \
+	}
+
+struct device_driver {
+	const char *name;
+	const struct dev_pm_ops *pm;
+};
+
+struct wmi_driver {
+	struct device_driver driver;
+	const struct wmi_device_id *id_table;
+	int (*probe)(struct wmi_device *wdev, const void *context);
+	void (*remove)(struct wmi_device *wdev);
+};
+
+int wmi_driver_register(struct wmi_driver *driver);
+void wmi_driver_unregister(struct wmi_driver *driver);
+
+acpi_status wmi_query_block(const char *guid, u8 instance,
+			    struct acpi_buffer *out);
+acpi_status wmi_evaluate_method(const char *guid, u8 instance, u32 method_id,
+				const struct acpi_buffer *in,
+				struct acpi_buffer *out);
+bool wmi_has_guid(const char *guid);
+u8 wmidev_instance_count(struct wmi_device *wdev);
+
+#endif /* _KSHIM_H_ */
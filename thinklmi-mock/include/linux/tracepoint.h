@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Tracepoints compile to nothing and are never enabled */
+#include <kshim.h>
+
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)	\
+	static inline void trace_##name(proto) { }		\
+	static inline bool trace_##name##_enabled(void) { return false; }
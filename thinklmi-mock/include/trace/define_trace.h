@@ -0,0 +1 @@
+/* Tracepoints are not built in the userspace driver */
@@ -0,0 +1,1215 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Userspace implementation of the kernel interfaces declared in
+ * include/kshim.h, plus the entry points mock.h gives the harness.
+ */
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kshim.h>
+#include "mock.h"
+
+int kshim_loglevel = KSHIM_LOG_WARN;
+const char *kshim_firmware_dir;
+
+static unsigned long kshim_alloc_count;
+
+unsigned long kshim_allocs(void)
+{
+	return __atomic_load_n(&kshim_alloc_count, __ATOMIC_RELAXED);
+}
+
+void kshim_printk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > kshim_loglevel)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+/* Module parameters */
+
+struct kshim_param {
+	const char *name;
+	const char *type;
+	void *value;
+};
+
+static struct kshim_param kshim_params[8];
+static int kshim_nparams;
+
+void kshim_param_register(const char *name, const char *type, void *value)
+{
+	if (kshim_nparams == ARRAY_SIZE(kshim_params))
+		abort();
+	kshim_params[kshim_nparams++] = (struct kshim_param) {
+		name, type, value
+	};
+}
+
+int kshim_param_set(const char *name, const char *value)
+{
+	struct kshim_param *param;
+	char *end;
+	long n;
+	int i;
+
+	for (i = 0; i < kshim_nparams; i++) {
+		param = &kshim_params[i];
+		if (strcmp(param->name, name))
+			continue;
+		if (!strcmp(param->type, "bool")) {
+			if (!strcmp(value, "Y") || !strcmp(value, "y") ||
+			    !strcmp(value, "1"))
+				*(bool *)param->value = true;
+			else if (!strcmp(value, "N") || !strcmp(value, "n") ||
+				 !strcmp(value, "0"))
+				*(bool *)param->value = false;
+			else
+				return -EINVAL;
+			return 0;
+		}
+		n = strtol(value, &end, 0);
+		if (!*value || *end)
+			return -EINVAL;
+		if (!strcmp(param->type, "uint")) {
+			if (n < 0 || n > UINT_MAX)
+				return -EINVAL;
+			*(unsigned int *)param->value = n;
+			return 0;
+		}
+		if (n < INT_MIN || n > INT_MAX)
+			return -EINVAL;
+		*(int *)param->value = n;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/* Memory */
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	__atomic_fetch_add(&kshim_alloc_count, 1, __ATOMIC_RELAXED);
+	if (flags & __GFP_ZERO)
+		return calloc(1, size ? size : 1);
+	return malloc(size ? size : 1);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	return kmalloc(size, flags | __GFP_ZERO);
+}
+
+void *kmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+	return kmalloc(n * size, flags);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return kmalloc_array(n, size, flags | __GFP_ZERO);
+}
+
+void *krealloc(const void *p, size_t size, gfp_t flags)
+{
+	__atomic_fetch_add(&kshim_alloc_count, 1, __ATOMIC_RELAXED);
+	return realloc((void *)p, size ? size : 1);
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+void *kvmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	return kmalloc_array(n, size, flags);
+}
+
+void *kvzalloc(size_t size, gfp_t flags)
+{
+	return kzalloc(size, flags);
+}
+
+void kvfree(const void *p)
+{
+	free((void *)p);
+}
+
+void *kmemdup(const void *src, size_t len, gfp_t flags)
+{
+	void *p = kmalloc(len, flags);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+char *kstrdup(const char *s, gfp_t flags)
+{
+	return s ? kmemdup(s, strlen(s) + 1, flags) : NULL;
+}
+
+void *memdup_user(const void *src, size_t len)
+{
+	void *p = kmemdup(src, len, GFP_KERNEL);
+
+	return p ? p : ERR_PTR(-ENOMEM);
+}
+
+void *memdup_user_nul(const void *src, size_t len)
+{
+	char *p = kmalloc(len + 1, GFP_KERNEL);
+
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+	memcpy(p, src, len);
+	p[len] = '\0';
+	return p;
+}
+
+int kstrtouint_from_user(const char *s, size_t count, unsigned int base,
+			 unsigned int *res)
+{
+	char buf[32], *end;
+	unsigned long n;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, s, count);
+	buf[count] = '\0';
+	errno = 0;
+	n = strtoul(buf, &end, base);
+	if (end == buf || (*end && strcmp(end, "\n")) || errno ||
+	    n > UINT_MAX || strchr(buf, '-'))
+		return -EINVAL;
+	*res = n;
+	return 0;
+}
+
+/* Strings */
+
+ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+	size_t len;
+
+	if (!count)
+		return -E2BIG;
+	len = strnlen(src, count);
+	if (len == count) {
+		memcpy(dest, src, count - 1);
+		dest[count - 1] = '\0';
+		return -E2BIG;
+	}
+	memcpy(dest, src, len + 1);
+	return len;
+}
+
+char *strreplace(char *s, char old, char new)
+{
+	for (; *s; ++s)
+		if (*s == old)
+			*s = new;
+	return s;
+}
+
+char *strnchr(const char *s, size_t count, int c)
+{
+	while (count-- && *s) {
+		if (*s == (char)c)
+			return (char *)s;
+		s++;
+	}
+	return NULL;
+}
+
+long strncpy_from_user(char *dst, const char *src, long count)
+{
+	long len = strnlen(src, count);
+
+	memcpy(dst, src, len < count ? len + 1 : len);
+	return len;
+}
+
+/* FNV-1a, the kernel's word-at-a-time hash isn't needed for correctness */
+u32 full_name_hash(const void *salt, const char *name, unsigned int len)
+{
+	u32 hash = 2166136261u ^ (u32)(uintptr_t)salt;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+u32 crc32_le(u32 crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+	return crc;
+}
+
+ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ktime_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Locks, wait queues and completions */
+
+void init_rwsem(struct rw_semaphore *sem)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&sem->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+}
+
+/*
+ * Waiters check their condition under the queue lock, so taking it here
+ * means a waker that changed the condition first can't be missed.
+ */
+void wake_up_interruptible(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void init_completion(struct completion *x)
+{
+	init_waitqueue_head(&x->wait);
+	x->done = false;
+}
+
+void complete_all(struct completion *x)
+{
+	pthread_mutex_lock(&x->wait.lock);
+	x->done = true;
+	pthread_cond_broadcast(&x->wait.cond);
+	pthread_mutex_unlock(&x->wait.lock);
+}
+
+bool completion_done(struct completion *x)
+{
+	return __atomic_load_n(&x->done, __ATOMIC_ACQUIRE);
+}
+
+void wait_for_completion(struct completion *x)
+{
+	wait_event_interruptible(x->wait, x->done);
+}
+
+/*
+ * Workqueues. Each has its own worker threads taking work in FIFO order.
+ * A work item is not touched after its function returns, as that may
+ * have freed it.
+ */
+
+#define KSHIM_WQ_THREADS 8
+
+struct workqueue_struct {
+	struct list_head node;
+	struct list_head queue;
+	pthread_t threads[KSHIM_WQ_THREADS];
+	struct work_struct *running[KSHIM_WQ_THREADS];
+	int nthreads;
+	bool stopping;
+};
+
+struct kshim_worker {
+	struct workqueue_struct *wq;
+	int id;
+};
+
+/* One lock for all workqueues keeps cancel_work_sync() simple */
+static pthread_mutex_t kshim_wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kshim_wq_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head kshim_wqs = { &kshim_wqs, &kshim_wqs };
+
+struct workqueue_struct *system_wq;
+struct workqueue_struct *system_long_wq;
+struct workqueue_struct *system_unbound_wq;
+
+static bool kshim_work_running(struct work_struct *work)
+{
+	struct workqueue_struct *wq;
+	int i;
+
+	for (wq = list_entry(kshim_wqs.next, struct workqueue_struct, node);
+	     &wq->node != &kshim_wqs;
+	     wq = list_entry(wq->node.next, struct workqueue_struct, node)) {
+		for (i = 0; i < wq->nthreads; i++) {
+			if (wq->running[i] == work)
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * The first queued item that isn't running anywhere. Like the kernel, a
+ * work item queued again while it runs waits for the first run to end.
+ */
+static struct work_struct *kshim_next_work(struct workqueue_struct *wq)
+{
+	struct list_head *pos;
+	struct work_struct *work;
+
+	for (pos = wq->queue.next; pos != &wq->queue; pos = pos->next) {
+		work = list_entry(pos, struct work_struct, entry);
+		if (!kshim_work_running(work))
+			return work;
+	}
+	return NULL;
+}
+
+static void *kshim_worker_fn(void *arg)
+{
+	struct kshim_worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
+	struct work_struct *work;
+	int id = worker->id;
+
+	free(worker);
+	pthread_mutex_lock(&kshim_wq_lock);
+	for (;;) {
+		while (!(work = kshim_next_work(wq)) &&
+		       !(wq->stopping && list_empty(&wq->queue)))
+			pthread_cond_wait(&kshim_wq_cond, &kshim_wq_lock);
+		if (!work)
+			break;
+		list_del(&work->entry);
+		INIT_LIST_HEAD(&work->entry);
+		work->pending = false;
+		wq->running[id] = work;
+		pthread_mutex_unlock(&kshim_wq_lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&kshim_wq_lock);
+		wq->running[id] = NULL;
+		pthread_cond_broadcast(&kshim_wq_cond);
+	}
+	pthread_mutex_unlock(&kshim_wq_lock);
+	return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...)
+{
+	struct workqueue_struct *wq;
+	struct kshim_worker *worker;
+	int i;
+
+	wq = calloc(1, sizeof(*wq));
+	if (!wq)
+		return NULL;
+	INIT_LIST_HEAD(&wq->queue);
+	wq->nthreads = max_active > 0 && max_active < KSHIM_WQ_THREADS ?
+		       max_active : KSHIM_WQ_THREADS;
+
+	for (i = 0; i < wq->nthreads; i++) {
+		worker = malloc(sizeof(*worker));
+		if (!worker)
+			abort();
+		worker->wq = wq;
+		worker->id = i;
+		if (pthread_create(&wq->threads[i], NULL, kshim_worker_fn,
+				   worker))
+			abort();
+	}
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	list_add_tail(&wq->node, &kshim_wqs);
+	pthread_mutex_unlock(&kshim_wq_lock);
+	return wq;
+}
+
+/* Runs whatever is still queued, then stops the workers */
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	wq->stopping = true;
+	pthread_cond_broadcast(&kshim_wq_cond);
+	pthread_mutex_unlock(&kshim_wq_lock);
+
+	for (i = 0; i < wq->nthreads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	list_del(&wq->node);
+	pthread_mutex_unlock(&kshim_wq_lock);
+	free(wq);
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	if (!work->pending) {
+		work->pending = true;
+		list_add_tail(&work->entry, &wq->queue);
+		pthread_cond_broadcast(&kshim_wq_cond);
+		queued = true;
+	}
+	pthread_mutex_unlock(&kshim_wq_lock);
+	return queued;
+}
+
+bool schedule_work(struct work_struct *work)
+{
+	return queue_work(system_wq, work);
+}
+
+static bool kshim_wait_work(struct work_struct *work, bool cancel)
+{
+	bool pending;
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	pending = work->pending;
+	if (pending && cancel) {
+		list_del(&work->entry);
+		INIT_LIST_HEAD(&work->entry);
+		work->pending = false;
+	}
+	while (work->pending || kshim_work_running(work))
+		pthread_cond_wait(&kshim_wq_cond, &kshim_wq_lock);
+	pthread_mutex_unlock(&kshim_wq_lock);
+	return pending;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	return kshim_wait_work(work, true);
+}
+
+bool flush_work(struct work_struct *work)
+{
+	return kshim_wait_work(work, false);
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	pthread_mutex_lock(&kshim_wq_lock);
+	for (i = 0; i < wq->nthreads; i++) {
+		while (!list_empty(&wq->queue) || wq->running[i]) {
+			pthread_cond_wait(&kshim_wq_cond, &kshim_wq_lock);
+			i = 0;
+		}
+	}
+	pthread_mutex_unlock(&kshim_wq_lock);
+}
+
+void kshim_flush_workqueues(void)
+{
+	flush_workqueue(system_wq);
+	flush_workqueue(system_long_wq);
+	flush_workqueue(system_unbound_wq);
+}
+
+void kshim_init(void)
+{
+	system_wq = alloc_workqueue("events", 0, 0);
+	system_long_wq = alloc_workqueue("events_long", 0, 0);
+	system_unbound_wq = alloc_workqueue("events_unbound", WQ_UNBOUND, 0);
+}
+
+void kshim_exit(void)
+{
+	destroy_workqueue(system_wq);
+	destroy_workqueue(system_long_wq);
+	destroy_workqueue(system_unbound_wq);
+	system_wq = system_long_wq = system_unbound_wq = NULL;
+}
+
+/* Character device */
+
+static struct cdev *kshim_cdev;
+
+struct kshim_file {
+	struct inode inode;
+	struct file file;
+};
+
+int alloc_chrdev_region(dev_t *dev, unsigned int first, unsigned int count,
+			const char *name)
+{
+	*dev = first;
+	return 0;
+}
+
+void unregister_chrdev_region(dev_t dev, unsigned int count)
+{
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	memset(cdev, 0, sizeof(*cdev));
+	cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	cdev->dev = dev;
+	kshim_cdev = cdev;
+	return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+	if (kshim_cdev == cdev)
+		kshim_cdev = NULL;
+}
+
+struct class *kshim_class_create(void)
+{
+	static int cls;
+
+	return (struct class *)&cls;
+}
+
+void class_destroy(struct class *cls)
+{
+}
+
+struct device *device_create(struct class *cls, struct device *parent,
+			     dev_t devt, void *drvdata, const char *fmt, ...)
+{
+	static struct device dev;
+
+	return &dev;
+}
+
+void device_destroy(struct class *cls, dev_t devt)
+{
+}
+
+struct file *kshim_dev_open(unsigned int flags, int *err)
+{
+	struct kshim_file *kf;
+
+	if (!kshim_cdev) {
+		*err = -ENODEV;
+		return NULL;
+	}
+	kf = calloc(1, sizeof(*kf));
+	if (!kf) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	kf->inode.i_cdev = kshim_cdev;
+	kf->file.f_op = kshim_cdev->ops;
+	kf->file.f_flags = flags;
+	*err = kf->file.f_op->open(&kf->inode, &kf->file);
+	if (*err) {
+		free(kf);
+		return NULL;
+	}
+	return &kf->file;
+}
+
+long kshim_dev_ioctl(struct file *file, unsigned int cmd, void *arg)
+{
+	return file->f_op->unlocked_ioctl(file, cmd, (unsigned long)arg);
+}
+
+ssize_t kshim_dev_read(struct file *file, void *buf, size_t count)
+{
+	loff_t pos = 0;
+
+	return file->f_op->read(file, buf, count, &pos);
+}
+
+void kshim_dev_close(struct file *file)
+{
+	struct kshim_file *kf = container_of(file, struct kshim_file, file);
+
+	if (file->f_op->release)
+		file->f_op->release(&kf->inode, file);
+	free(kf);
+}
+
+loff_t default_llseek(struct file *file, loff_t offset, int whence)
+{
+	return -ESPIPE;
+}
+
+ssize_t simple_read_from_buffer(void *to, size_t count, loff_t *ppos,
+				const void *from, size_t available)
+{
+	loff_t pos = *ppos;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= available || !count)
+		return 0;
+	if (count > available - pos)
+		count = available - pos;
+	memcpy(to, (const char *)from + pos, count);
+	*ppos = pos + count;
+	return count;
+}
+
+int fasync_helper(int fd, struct file *filp, int on,
+		  struct fasync_struct **fapp)
+{
+	return 0;
+}
+
+void kill_fasync(struct fasync_struct **fp, int sig, int band)
+{
+}
+
+struct eventfd_ctx {
+	int fd;
+};
+
+struct eventfd_ctx *eventfd_ctx_fdget(int fd)
+{
+	struct eventfd_ctx *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+	ctx->fd = dup(fd);
+	if (ctx->fd < 0) {
+		free(ctx);
+		return ERR_PTR(-EBADF);
+	}
+	return ctx;
+}
+
+void eventfd_ctx_put(struct eventfd_ctx *ctx)
+{
+	close(ctx->fd);
+	free(ctx);
+}
+
+void eventfd_signal(struct eventfd_ctx *ctx)
+{
+	u64 one = 1;
+
+	if (write(ctx->fd, &one, sizeof(one)) != sizeof(one))
+		pr_warn("kshim: eventfd write failed\n");
+}
+
+/*
+ * seq_file. The whole output is produced on the first read and served
+ * from the buffer after that, which is all debugfs readers here need.
+ */
+
+static int kshim_seq_alloc(struct file *file, const struct seq_operations *op,
+			   int (*show)(struct seq_file *, void *), void *data)
+{
+	struct seq_file *m = calloc(1, sizeof(*m));
+
+	if (!m)
+		return -ENOMEM;
+	m->op = op;
+	m->single_show = show;
+	m->private = data;
+	file->private_data = m;
+	return 0;
+}
+
+int seq_open(struct file *file, const struct seq_operations *op)
+{
+	return kshim_seq_alloc(file, op, NULL, NULL);
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	return kshim_seq_alloc(file, NULL, show, data);
+}
+
+static void kshim_seq_write(struct seq_file *m, const char *s, size_t len)
+{
+	size_t size = m->size ? m->size : 256;
+	char *buf;
+
+	while (m->count + len + 1 > size)
+		size *= 2;
+	if (size != m->size) {
+		buf = realloc(m->buf, size);
+		if (!buf)
+			abort();
+		m->buf = buf;
+		m->size = size;
+	}
+	memcpy(m->buf + m->count, s, len);
+	m->count += len;
+	m->buf[m->count] = '\0';
+}
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int len;
+
+	va_start(ap, fmt);
+	len = vasprintf(&s, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		abort();
+	kshim_seq_write(m, s, len);
+	free(s);
+}
+
+void seq_puts(struct seq_file *m, const char *s)
+{
+	kshim_seq_write(m, s, strlen(s));
+}
+
+void seq_putc(struct seq_file *m, char c)
+{
+	kshim_seq_write(m, &c, 1);
+}
+
+void seq_escape(struct seq_file *m, const char *s, const char *esc)
+{
+	char oct[5];
+
+	for (; *s; s++) {
+		if (strchr(esc, *s)) {
+			snprintf(oct, sizeof(oct), "\\%03o", (unsigned char)*s);
+			kshim_seq_write(m, oct, 4);
+		} else {
+			kshim_seq_write(m, s, 1);
+		}
+	}
+}
+
+static int kshim_seq_fill(struct seq_file *m)
+{
+	loff_t pos = 0;
+	void *p;
+	int ret = 0;
+
+	if (m->single_show)
+		return m->single_show(m, NULL);
+
+	p = m->op->start(m, &pos);
+	while (!IS_ERR_OR_NULL(p)) {
+		ret = m->op->show(m, p);
+		if (ret)
+			break;
+		p = m->op->next(m, p, &pos);
+	}
+	m->op->stop(m, p);
+	return IS_ERR(p) ? PTR_ERR(p) : ret;
+}
+
+ssize_t seq_read(struct file *file, char *buf, size_t size, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	int ret;
+
+	if (!m->filled) {
+		ret = kshim_seq_fill(m);
+		if (ret)
+			return ret;
+		m->filled = true;
+	}
+	return simple_read_from_buffer(buf, size, ppos, m->buf, m->count);
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return -ESPIPE;
+}
+
+int seq_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	free(m->buf);
+	free(m);
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	return seq_release(inode, file);
+}
+
+/* debugfs, kept as a flat list of entries with parent links */
+
+enum kshim_dentry_kind {
+	KSHIM_DEBUGFS_DIR,
+	KSHIM_DEBUGFS_FILE,
+	KSHIM_DEBUGFS_ULONG,
+	KSHIM_DEBUGFS_U64,
+	KSHIM_DEBUGFS_ATOMIC,
+};
+
+struct dentry {
+	struct dentry *next;
+	struct dentry *parent;
+	enum kshim_dentry_kind kind;
+	char name[64];
+	void *data;
+	const struct file_operations *fops;
+};
+
+static struct dentry *kshim_dentries;
+static pthread_mutex_t kshim_debugfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dentry *kshim_debugfs_add(const char *name,
+					struct dentry *parent,
+					enum kshim_dentry_kind kind,
+					void *data,
+					const struct file_operations *fops)
+{
+	struct dentry *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		abort();
+	strscpy(d->name, name, sizeof(d->name));
+	d->parent = parent;
+	d->kind = kind;
+	d->data = data;
+	d->fops = fops;
+
+	pthread_mutex_lock(&kshim_debugfs_lock);
+	d->next = kshim_dentries;
+	kshim_dentries = d;
+	pthread_mutex_unlock(&kshim_debugfs_lock);
+	return d;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return kshim_debugfs_add(name, parent, KSHIM_DEBUGFS_DIR, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	return kshim_debugfs_add(name, parent, KSHIM_DEBUGFS_FILE, data, fops);
+}
+
+void debugfs_create_ulong(const char *name, umode_t mode,
+			  struct dentry *parent, unsigned long *value)
+{
+	kshim_debugfs_add(name, parent, KSHIM_DEBUGFS_ULONG, value, NULL);
+}
+
+void debugfs_create_u64(const char *name, umode_t mode,
+			struct dentry *parent, u64 *value)
+{
+	kshim_debugfs_add(name, parent, KSHIM_DEBUGFS_U64, value, NULL);
+}
+
+void debugfs_create_atomic_t(const char *name, umode_t mode,
+			     struct dentry *parent, atomic_t *value)
+{
+	kshim_debugfs_add(name, parent, KSHIM_DEBUGFS_ATOMIC, value, NULL);
+}
+
+static bool kshim_debugfs_under(struct dentry *d, struct dentry *dir)
+{
+	for (; d; d = d->parent) {
+		if (d == dir)
+			return true;
+	}
+	return false;
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	struct dentry **p, *d;
+
+	if (!dentry)
+		return;
+	pthread_mutex_lock(&kshim_debugfs_lock);
+	/* Children are added after their parent, so they come first */
+	for (p = &kshim_dentries; (d = *p);) {
+		if (kshim_debugfs_under(d, dentry)) {
+			*p = d->next;
+			free(d);
+		} else {
+			p = &d->next;
+		}
+	}
+	pthread_mutex_unlock(&kshim_debugfs_lock);
+}
+
+static struct dentry *kshim_debugfs_lookup(const char *path)
+{
+	struct dentry *d, *parent = NULL;
+	const char *end;
+	size_t len;
+
+	for (;;) {
+		end = strchrnul(path, '/');
+		len = end - path;
+		for (d = kshim_dentries; d; d = d->next) {
+			if (d->parent == parent && strlen(d->name) == len &&
+			    !strncmp(d->name, path, len))
+				break;
+		}
+		if (!d || !*end)
+			return d;
+		parent = d;
+		path = end + 1;
+	}
+}
+
+/* Paths are relative to the debugfs root, like "think-lmi/settings" */
+ssize_t kshim_debugfs_read(const char *path, char *buf, size_t size)
+{
+	struct inode inode = { 0 };
+	struct file file = { 0 };
+	struct dentry *d;
+	ssize_t len = 0, ret;
+	loff_t pos = 0;
+
+	if (!size)
+		return -EINVAL;
+
+	pthread_mutex_lock(&kshim_debugfs_lock);
+	d = kshim_debugfs_lookup(path);
+	pthread_mutex_unlock(&kshim_debugfs_lock);
+	if (!d)
+		return -ENOENT;
+
+	switch (d->kind) {
+	case KSHIM_DEBUGFS_DIR:
+		return -EISDIR;
+	case KSHIM_DEBUGFS_ULONG:
+		return snprintf(buf, size, "%lu\n", *(unsigned long *)d->data);
+	case KSHIM_DEBUGFS_U64:
+		return snprintf(buf, size, "%llu\n", *(u64 *)d->data);
+	case KSHIM_DEBUGFS_ATOMIC:
+		return snprintf(buf, size, "%d\n", atomic_read((atomic_t *)d->data));
+	case KSHIM_DEBUGFS_FILE:
+		break;
+	}
+
+	inode.i_private = d->data;
+	file.f_op = d->fops;
+	ret = d->fops->open(&inode, &file);
+	if (ret)
+		return ret;
+	while ((ret = d->fops->read(&file, buf + len, size - 1 - len,
+				    &pos)) > 0)
+		len += ret;
+	d->fops->release(&inode, &file);
+	if (ret < 0)
+		return ret;
+	buf[len] = '\0';
+	return len;
+}
+
+/* Only files with a write handler can be written, in one go */
+ssize_t kshim_debugfs_write(const char *path, const char *buf)
+{
+	struct inode inode = { 0 };
+	struct file file = { 0 };
+	struct dentry *d;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	pthread_mutex_lock(&kshim_debugfs_lock);
+	d = kshim_debugfs_lookup(path);
+	pthread_mutex_unlock(&kshim_debugfs_lock);
+	if (!d)
+		return -ENOENT;
+	if (d->kind != KSHIM_DEBUGFS_FILE || !d->fops->write)
+		return -EPERM;
+
+	inode.i_private = d->data;
+	file.f_op = d->fops;
+	ret = d->fops->open(&inode, &file);
+	if (ret)
+		return ret;
+	ret = d->fops->write(&file, buf, strlen(buf), &pos);
+	d->fops->release(&inode, &file);
+	return ret;
+}
+
+/* DMI */
+
+static const char *kshim_dmi[DMI_STRING_MAX] = {
+	[DMI_SYS_VENDOR] = "LENOVO",
+};
+
+void kshim_dmi_set(int field, const char *value)
+{
+	if (field > DMI_NONE && field < DMI_STRING_MAX)
+		kshim_dmi[field] = value;
+}
+
+const char *dmi_get_system_info(int field)
+{
+	return field > DMI_NONE && field < DMI_STRING_MAX ?
+	       kshim_dmi[field] : NULL;
+}
+
+const struct dmi_system_id *dmi_first_match(const struct dmi_system_id *list)
+{
+	const struct dmi_system_id *id;
+	const char *value;
+	int i;
+
+	for (id = list; id->matches[0].slot != DMI_NONE; id++) {
+		for (i = 0; i < ARRAY_SIZE(id->matches); i++) {
+			if (id->matches[i].slot == DMI_NONE)
+				continue;
+			value = dmi_get_system_info(id->matches[i].slot);
+			if (!value || !strstr(value, id->matches[i].substr))
+				break;
+		}
+		if (i == ARRAY_SIZE(id->matches))
+			return id;
+	}
+	return NULL;
+}
+
+/* Firmware */
+
+int request_firmware_direct(const struct firmware **fw, const char *name,
+			    struct device *device)
+{
+	struct firmware *f;
+	char path[PATH_MAX];
+	long size;
+	FILE *fp;
+	u8 *data;
+
+	*fw = NULL;
+	if (!kshim_firmware_dir)
+		return -ENOENT;
+	snprintf(path, sizeof(path), "%s/%s", kshim_firmware_dir, name);
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -ENOENT;
+
+	f = calloc(1, sizeof(*f));
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) || !f)
+		goto fail;
+	data = malloc(size ? size : 1);
+	if (!data)
+		goto fail;
+	if (fread(data, 1, size, fp) != size) {
+		free(data);
+		goto fail;
+	}
+	fclose(fp);
+	f->data = data;
+	f->size = size;
+	*fw = f;
+	return 0;
+
+fail:
+	free(f);
+	fclose(fp);
+	return -EIO;
+}
+
+void release_firmware(const struct firmware *fw)
+{
+	if (fw) {
+		free((void *)fw->data);
+		free((void *)fw);
+	}
+}
+
+/* WMI driver binding; the WMI calls themselves are in fake-bios.c */
+
+static struct wmi_driver *kshim_wmi_driver;
+static struct wmi_device kshim_wmi_device;
+static bool kshim_wmi_bound;
+
+int wmi_driver_register(struct wmi_driver *driver)
+{
+	kshim_wmi_driver = driver;
+	return 0;
+}
+
+void wmi_driver_unregister(struct wmi_driver *driver)
+{
+	if (kshim_wmi_bound)
+		kshim_wmi_remove();
+	kshim_wmi_driver = NULL;
+}
+
+int kshim_wmi_probe(void)
+{
+	int ret;
+
+	if (!kshim_wmi_driver)
+		return -ENODEV;
+	if (kshim_wmi_bound)
+		return -EBUSY;
+	if (!wmi_has_guid(kshim_wmi_driver->id_table[0].guid_string))
+		return -ENODEV;
+	memset(&kshim_wmi_device, 0, sizeof(kshim_wmi_device));
+	ret = kshim_wmi_driver->probe(&kshim_wmi_device,
+				      kshim_wmi_driver->id_table[0].context);
+	kshim_wmi_bound = !ret;
+	return ret;
+}
+
+int kshim_wmi_suspend(void)
+{
+	const struct dev_pm_ops *pm;
+
+	if (!kshim_wmi_bound)
+		return -ENODEV;
+	pm = kshim_wmi_driver->driver.pm;
+	return pm && pm->suspend ? pm->suspend(&kshim_wmi_device.dev) : 0;
+}
+
+int kshim_wmi_resume(void)
+{
+	const struct dev_pm_ops *pm;
+
+	if (!kshim_wmi_bound)
+		return -ENODEV;
+	pm = kshim_wmi_driver->driver.pm;
+	return pm && pm->resume ? pm->resume(&kshim_wmi_device.dev) : 0;
+}
+
+void kshim_wmi_remove(void)
+{
+	if (!kshim_wmi_bound)
+		return;
+	kshim_wmi_driver->remove(&kshim_wmi_device);
+	kshim_wmi_bound = false;
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Interface of the userspace build of the think-lmi driver to the
+ * programs that drive it. It needs none of the kernel shim, so it can
+ * be used next to the uapi header think-lmi.h.
+ */
+
+#ifndef _THINK_LMI_MOCK_H_
+#define _THINK_LMI_MOCK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct file;
+
+/* Kernel shim (kshim.c) */
+
+extern int kshim_loglevel;	/* 0 errors .. 3 debug, default 1 */
+extern const char *kshim_firmware_dir; /* NULL: no firmware is found */
+
+void kshim_init(void);
+void kshim_exit(void);
+void kshim_flush_workqueues(void); /* Wait for background work to finish */
+int kshim_param_set(const char *name, const char *value);
+void kshim_dmi_set(int field, const char *value);
+unsigned long kshim_allocs(void);
+
+/* The driver's module_init() and module_exit() */
+int kshim_module_init(void);
+void kshim_module_exit(void);
+
+/* Bind and unbind the registered WMI driver, as the WMI core would */
+int kshim_wmi_probe(void);
+void kshim_wmi_remove(void);
+
+/* System sleep, with the BIOS free to change settings in between */
+int kshim_wmi_suspend(void);
+int kshim_wmi_resume(void);
+
+/* Open the driver's character device, like /dev/thinklmi */
+struct file *kshim_dev_open(unsigned int flags, int *err);
+long kshim_dev_ioctl(struct file *file, unsigned int cmd, void *arg);
+ssize_t kshim_dev_read(struct file *file, void *buf, size_t count);
+void kshim_dev_close(struct file *file);
+
+/* Read a whole debugfs file, like "think-lmi/stats/bios_setting" */
+ssize_t kshim_debugfs_read(const char *path, char *buf, size_t size);
+ssize_t kshim_debugfs_write(const char *path, const char *buf);
+
+/* Fake BIOS (fake-bios.c) */
+
+/* WMI classes of the BIOS, used to name them in scripts and counters */
+enum fake_bios_class {
+	FAKE_BIOS_SETTING,
+	FAKE_SET_BIOS_SETTINGS,
+	FAKE_SAVE_BIOS_SETTINGS,
+	FAKE_DISCARD_BIOS_SETTINGS,
+	FAKE_LOAD_DEFAULT_SETTINGS,
+	FAKE_BIOS_PASSWORD_SETTINGS,
+	FAKE_SET_BIOS_PASSWORD,
+	FAKE_GET_BIOS_SELECTIONS,
+	FAKE_PLATFORM_SETTING,
+	FAKE_SET_PLATFORM_SETTINGS,
+	FAKE_LMIOPCODE,
+	FAKE_BIOS_CLASSES
+};
+
+int fake_bios_load(const char *path);
+int fake_bios_replay(const char *path);	/* A trace from the driver's capture */
+void fake_bios_generate(int count);
+void fake_bios_free(void);
+void fake_bios_set_latency(enum fake_bios_class cls, unsigned int us);
+void fake_bios_set_query_latency(unsigned int us);
+void fake_bios_set_method_latency(unsigned int us);
+const char *fake_bios_class_name(enum fake_bios_class cls);
+bool fake_bios_has(enum fake_bios_class cls); /* Not left out by "missing" */
+
+/* Instance slots, including empty ones, and what the BIOS holds */
+int fake_bios_slots(void);
+const char *fake_bios_name(int slot);
+const char *fake_bios_value(int slot);
+const char *fake_bios_choices(int slot);
+/* Change a saved value behind the driver's back, as BIOS setup would */
+int fake_bios_change(int slot, const char *value);
+/* Rename a setting, as a BIOS update might */
+int fake_bios_rename(int slot, const char *name);
+/* Drop values set but not saved, as a reboot would */
+void fake_bios_discard(void);
+
+/* Calls made since the last reset */
+void fake_bios_reset_calls(void);
+unsigned long fake_bios_calls(enum fake_bios_class cls);
+unsigned long fake_bios_queries(void);
+unsigned long fake_bios_methods(void);
+
+#endif /* _THINK_LMI_MOCK_H_ */
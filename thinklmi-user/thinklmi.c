@@ -28,13 +28,38 @@
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
  
 #include "../thinklmi-kernel/think-lmi.h"
 
+/*
+ * Issue a v2 request. Only in_len bytes of input are passed. If out is
+ * given, *out_len is its size on entry and the size of the result (or the
+ * size needed, with ENOSPC) on return.
+ */
+static int thinklmi_request(int fd, unsigned long cmd, const void *in,
+			    unsigned int in_len, void *out,
+			    unsigned int *out_len)
+{
+	struct tlmi_buf req;
+	int err;
+
+	req.in = (unsigned long)in;
+	req.in_len = in_len;
+	req.out = (unsigned long)out;
+	req.out_len = out ? *out_len : 0;
+	err = ioctl(fd, cmd, &req);
+	if (out_len)
+		*out_len = req.out_len;
+	return err;
+}
+
 void get_settings_all(int fd)
 {
-    int i, settings_count;
-    unsigned char settings_str[TLMI_SETTINGS_MAXLEN];
+    int settings_count;
+    char settings_str[TLMI_SETTINGS_MAXLEN];
+    unsigned int len;
+    __u32 i;
 
     if (ioctl(fd, THINKLMI_GET_SETTINGS, &settings_count) == -1) {
         perror("query_apps ioctl get");
@@ -42,9 +67,9 @@ void get_settings_all(int fd)
 	printf("Total settings: %d\n", settings_count);
 	for(i=0; i <= TLMI_MAX_SETTINGS; i++)
 	{
-		settings_str[0] = i;
-                
-                if (ioctl(fd, THINKLMI_GET_SETTINGS_STRING, &settings_str) >= 0)
+		len = sizeof(settings_str);
+                if (thinklmi_request(fd, THINKLMI_GET_SETTINGS_STRING_V2,
+				     &i, sizeof(i), settings_str, &len) >= 0)
 			printf("%3.3d: %s\n", i, settings_str);
                 /*else
 			printf("%3.3d:\n", i);*/
@@ -52,31 +77,240 @@ void get_settings_all(int fd)
     }
 }
 
-void thinklmi_get(int fd, char * argv2)
+void thinklmi_get_all(int fd)
+{
+	__s32 indices[TLMI_MAX_SETTINGS + 1];
+	struct tlmi_get_vec vec;
+	struct tlmi_vec_record *rec;
+	char *buf = NULL, *p;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i <= TLMI_MAX_SETTINGS; i++)
+		indices[i] = i;
+
+	memset(&vec, 0, sizeof(vec));
+	vec.count = TLMI_MAX_SETTINGS + 1;
+	vec.keys = (unsigned long)indices;
+	vec.needed = 64 * 1024;
+	/* Grow the buffer until every record fits */
+	do {
+		free(buf);
+		vec.buf_len = vec.needed;
+		buf = malloc(vec.buf_len);
+		if (!buf) {
+			perror("Out of memory");
+			return;
+		}
+		vec.buf = (unsigned long)buf;
+		err = ioctl(fd, THINKLMI_GET_VEC, &vec);
+	} while (err == -1 && errno == ENOSPC);
+
+	if (err == -1) {
+		perror("Unable to read settings");
+		free(buf);
+		return;
+	}
+
+	p = buf;
+	for (i = 0; i < vec.done; i++) {
+		rec = (struct tlmi_vec_record *)p;
+		if (!rec->status) {
+			char *name = p + sizeof(*rec);
+			char *value = name + rec->name_len;
+
+			printf("%3.3d: %s,%s", rec->index, name, value);
+			if (rec->choices_len)
+				printf(" [%s]", value + rec->value_len);
+			printf("\n");
+		}
+		p += TLMI_VEC_RECORD_SIZE(rec);
+	}
+	free(buf);
+}
+
+void thinklmi_get(int fd, char * argv2, int refresh)
 {
-	char settings_str[TLMI_SETTINGS_MAXLEN];
+	unsigned long cmd = refresh ? THINKLMI_REFRESH_SETTING_V2 :
+				      THINKLMI_SHOW_SETTING_V2;
+	unsigned int len = TLMI_SETTINGS_MAXLEN;
+	char *settings_str = NULL;
 	int err;
-        strncpy(settings_str, argv2, TLMI_SETTINGS_MAXLEN);
-	err = ioctl(fd, THINKLMI_SHOW_SETTING, &settings_str);
+
+	/* Retry with the size the driver asks for if the result is long */
+	do {
+		free(settings_str);
+		settings_str = malloc(len);
+		if (!settings_str) {
+		   perror("Out of memory");
+		   return;
+		}
+		err = thinklmi_request(fd, cmd, argv2, strlen(argv2),
+				       settings_str, &len);
+		cmd = THINKLMI_SHOW_SETTING_V2;
+	} while (err == -1 && errno == ENOSPC);
+
 	if(err == -1)
 	   perror("Invalid setting name");
 	else
            printf("%s\n", settings_str);
+	free(settings_str);
 }
 
 void thinklmi_set(int fd, char * argv2, char* argv3)
 {
 	char setting_string[TLMI_GETSET_MAXLEN];
-        strncpy(setting_string, argv2, TLMI_SETTINGS_MAXLEN);
-	strcat(setting_string, ",");
-	strncat(setting_string, argv3, TLMI_SETTINGS_MAXLEN);
+	unsigned int len = TLMI_GETSET_MAXLEN;
+	char *choices = NULL;
+	int err;
+
+	snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s,%s", argv2, argv3);
+	/*
+	 * A refused value fails before the BIOS is called, so it is safe to
+	 * retry if its list of choices needs a bigger buffer
+	 */
+	do {
+		free(choices);
+		choices = malloc(len);
+		if (!choices) {
+		   perror("Out of memory");
+		   return;
+		}
+		choices[0] = '\0';
+		err = thinklmi_request(fd, THINKLMI_SET_SETTING_V2,
+				       setting_string, strlen(setting_string),
+				       choices, &len);
+	} while (err == -1 && errno == ENOSPC);
 
-	if(ioctl(fd, THINKLMI_SET_SETTING, &setting_string) == -1) {
+	if(err == -1) {
 	   perror("Unable to change setting");
+	   /* On an invalid value the driver returns the valid choices */
+	   if (errno == EINVAL && choices[0])
+	      printf("Valid choices: %s\n", choices);
 	} else {
            printf("BIOS Setting changed\n");
            printf("Setting will not change until reboot\n");
 	}
+	free(choices);
+}
+
+/* Print BIOS configuration changes as they happen */
+void thinklmi_watch(int fd)
+{
+	static const char * const reasons[] = {
+		[TLMI_CHANGE_SET] = "set",
+		[TLMI_CHANGE_SAVE] = "save",
+		[TLMI_CHANGE_LOAD_DEFAULT] = "load default",
+		[TLMI_CHANGE_TPM] = "tpm type",
+		[TLMI_CHANGE_PASSWORD] = "password",
+		[TLMI_CHANGE_LOST] = "events lost",
+	};
+	char buf[8192], name[TLMI_SETTINGS_MAXLEN];
+	struct tlmi_change *change;
+	struct tlmi_event *ev;
+	unsigned int len;
+	ssize_t n, off;
+	__u32 i, index;
+
+	if (ioctl(fd, THINKLMI_WATCH, 1) == -1) {
+		perror("Unable to watch for changes");
+		return;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += ev->size) {
+			ev = (struct tlmi_event *)(buf + off);
+			if (ev->type != TLMI_EVENT_CHANGE)
+				continue;
+			change = (struct tlmi_change *)ev;
+			printf("%llu: ", (unsigned long long)change->generation);
+			if (change->reason < sizeof(reasons) / sizeof(reasons[0]) &&
+			    reasons[change->reason])
+				printf("%s", reasons[change->reason]);
+			else
+				printf("reason %u", change->reason);
+			if (!change->count)
+				printf(" (all settings)");
+			for (i = 0; i < change->count; i++) {
+				index = change->index[i];
+				len = sizeof(name);
+				if (thinklmi_request(fd, THINKLMI_GET_SETTINGS_STRING_V2,
+						     &index, sizeof(index),
+						     name, &len) == -1)
+					snprintf(name, sizeof(name), "%u", index);
+				printf(" %s", name);
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	if (n == -1)
+		perror("Unable to read changes");
+}
+
+void thinklmi_batch_set(int fd, char *file_name)
+{
+	static struct tlmi_setting_pair items[TLMI_BATCH_MAX];
+	struct tlmi_batch_set batch;
+	char line[TLMI_GETSET_MAXLEN];
+	size_t name_len, value_len;
+	char *value;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(file_name, "r");
+	if (!fp) {
+	   perror("Unable to open settings file");
+	   return;
+	}
+
+	/* One "setting,value" pair per line, all or nothing */
+	batch.count = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strchr(line, '\n') && !feof(fp)) {
+			printf("Line too long in %s\n", file_name);
+			goto fail;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		value = strchr(line, ',');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		if (batch.count == TLMI_BATCH_MAX) {
+			printf("More than %d settings in %s\n", TLMI_BATCH_MAX,
+			       file_name);
+			goto fail;
+		}
+		name_len = strlen(line);
+		value_len = strlen(value);
+		if (name_len >= TLMI_SETTINGS_MAXLEN ||
+		    value_len >= TLMI_SETTINGS_MAXLEN) {
+			printf("%.64s: name or value too long\n", line);
+			goto fail;
+		}
+		memcpy(items[batch.count].name, line, name_len + 1);
+		memcpy(items[batch.count].value, value, value_len + 1);
+		batch.count++;
+	}
+	fclose(fp);
+
+	batch.items = (unsigned long)items;
+	if(ioctl(fd, THINKLMI_BATCH_SET, &batch) == -1) {
+	   perror("Unable to change settings");
+	   for (i = 0; i < batch.count; i++) {
+		   if (items[i].status && items[i].status != -ECANCELED)
+			   printf("%s: %s\n", items[i].name, strerror(-items[i].status));
+	   }
+	   printf("No settings were changed\n");
+	} else {
+	   printf("%u BIOS Settings changed\n", batch.count);
+	   printf("Setting will not change until reboot\n");
+	}
+	return;
+
+fail:
+	fclose(fp);
+	printf("No settings were changed\n");
 }
 
 void thinklmi_authenticate(int fd, char *passwd, char *encode, char *lang )
@@ -84,20 +318,41 @@ void thinklmi_authenticate(int fd, char *passwd, char *encode, char *lang )
 	char setting_string[TLMI_GETSET_MAXLEN];
 
 	snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s,%s,%s", passwd, encode, lang);
-        if(ioctl(fd, THINKLMI_AUTHENTICATE, &setting_string) == -1) {
+        if(thinklmi_request(fd, THINKLMI_AUTHENTICATE_V2, setting_string,
+			    strlen(setting_string), NULL, NULL) == -1) {
 	   perror("BIOS authenticate failed");
 	} else {
-	   printf("BIOS authentication completed\n");
-           printf("This will be valid till the next reboot\n");
+	   /* The details are dropped when we exit and close the device */
+	   printf("Authentication details accepted, but the login does not persist\n");
+	   printf("Set THINKLMI_AUTH to authenticate other commands\n");
 	}
 }
 
+/*
+ * Authentication only lasts as long as the device stays open, so take the
+ * credentials for this run from THINKLMI_AUTH ("password,encoding,kbdlang").
+ */
+static int thinklmi_auth_from_env(int fd)
+{
+	const char *auth = getenv("THINKLMI_AUTH");
+
+	if (!auth || !*auth)
+		return 0;
+	if (thinklmi_request(fd, THINKLMI_AUTHENTICATE_V2, auth,
+			     strlen(auth), NULL, NULL) == -1) {
+		perror("BIOS authenticate failed");
+		return -1;
+	}
+	return 0;
+}
+
 void thinklmi_change_password(int fd, char *oldpass, char *newpass, char *passtype, char *encode, char *lang)
 {
 	char setting_string[TLMI_GETSET_MAXLEN];
 
 	snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s,%s,%s,%s,%s;", passtype, oldpass, newpass, encode, lang);
-        if(ioctl(fd, THINKLMI_CHANGE_PASSWORD, &setting_string) == -1) {
+        if(thinklmi_request(fd, THINKLMI_CHANGE_PASSWORD_V2, setting_string,
+			    strlen(setting_string), NULL, NULL) == -1) {
 	   perror("BIOS password change failed");
 	} else {
 	   printf("BIOS password changed\n");
@@ -108,10 +363,10 @@ void thinklmi_change_password(int fd, char *oldpass, char *newpass, char *passty
 void thinklmi_debug(int fd, char *settingname, char *value)
 {
 	char setting_string[TLMI_GETSET_MAXLEN];
-        strncpy(setting_string, settingname, TLMI_SETTINGS_MAXLEN);
-	strcat(setting_string, ",");
-	strncat(setting_string, value, TLMI_SETTINGS_MAXLEN);
-	if(ioctl(fd, THINKLMI_DEBUG, &setting_string) == -1) {
+
+	snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s,%s", settingname, value);
+	if(thinklmi_request(fd, THINKLMI_DEBUG_V2, setting_string,
+			    strlen(setting_string), NULL, NULL) == -1) {
 	   perror("Debug Setting Error");
 	} else {
 	   printf("Debug Setting changed\n");
@@ -120,10 +375,29 @@ void thinklmi_debug(int fd, char *settingname, char *value)
 
 void thinklmi_lmiopcode(int fd, char *admin, char *passtype, char *oldpass, char *newpass )
 {
-	char setting_string[TLMI_GETSET_MAXLEN];
-	snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s,%s,%s,%s;", admin, passtype, oldpass, newpass);
-        if(ioctl(fd, THINKLMI_LMIOPCODE, &setting_string) == -1) {
+	struct tlmi_opcode steps[5];
+	struct tlmi_opcode_seq seq;
+	const char *args[5] = { admin, passtype, oldpass, newpass, "" };
+	const char *opcodes[5] = { "PasswordAdmin", "PasswordType",
+				   "PasswordCurrent01", "PasswordNew01",
+				   "PasswordSetUpdate" };
+	int i;
+
+	memset(steps, 0, sizeof(steps));
+	for (i = 0; i < 5; i++) {
+		snprintf(steps[i].opcode, TLMI_OPCODE_MAXLEN, "%s", opcodes[i]);
+		snprintf(steps[i].arg, TLMI_SETTINGS_MAXLEN, "%s", args[i]);
+	}
+	/* Empty passwords are still sent, PasswordSetUpdate takes none */
+	steps[4].flags = TLMI_OPCODE_NO_ARG;
+	memset(&seq, 0, sizeof(seq));
+	seq.count = 5;
+	seq.steps = (unsigned long)steps;
+        if(ioctl(fd, THINKLMI_OPCODE_SEQ, &seq) == -1) {
 	   perror("BIOS password change failed");
+	   if (seq.failed >= 0 && seq.failed < 5)
+		   printf("%s: %s\n", steps[seq.failed].opcode,
+			  strerror(-steps[seq.failed].status));
 	} else {
 	   printf("BIOS password changed\n");
            printf("Setting will not change until reboot\n");
@@ -141,7 +415,8 @@ void thinklmi_tpmtype(int fd, char *tpmtype)
 	scanf("%c", &option);
 	if(tolower(option) == 'y' && tolower(option) != 'n') {
            snprintf(setting_string, TLMI_GETSET_MAXLEN, "%s;", tpmtype);
-           if(ioctl(fd, THINKLMI_TPMTYPE, &setting_string) == -1) {
+           if(thinklmi_request(fd, THINKLMI_TPMTYPE_V2, setting_string,
+			       strlen(setting_string), NULL, NULL) == -1) {
               perror("TPM type change failed");
            } else {
               printf("TPM type changed\n");
@@ -171,12 +446,16 @@ void thinklmi_save_settings(int fd)
 
 static void show_usage(void)
 {
-	fprintf(stdout, "Usage: thinklmi [-g | -s | -p | -c | -d | -l | -w | getsettings| save settings] <options>\n");
+	fprintf(stdout, "Usage: thinklmi [-g | -r | -s | -b | -p | -c | -d | -l | -w | getsettings| save settings] <options>\n");
 	fprintf(stdout, "Option details:  \n");
 	fprintf(stdout, "\t getsettings - display all available BIOS options:  \n");
+	fprintf(stdout, "\t getall - display all BIOS options with their values and choices\n");
+	fprintf(stdout, "\t watch - print BIOS configuration changes as they are made\n");
 	fprintf(stdout, "\t -g [BIOS option] - Get the current setting and choices for given BIOS option\n");
+	fprintf(stdout, "\t -r [BIOS option] - As -g, but re-read the setting from the BIOS\n");
 	fprintf(stdout, "\t -s [BIOS option] [value] - Set the given BIOS option to given value\n");
-	fprintf(stdout, "\t -p [password] [encoding] [kbdlang] - Set authentication details. \n");
+	fprintf(stdout, "\t -b [file] - Set all BIOS options listed as option,value lines in file\n");
+	fprintf(stdout, "\t -p [password] [encoding] [kbdlang] - Check authentication details, the login does not persist. \n");
 	fprintf(stdout, "\t -c [password] [new password] [password type] [encoding] [kbdlang] - Change password. \n");
 	fprintf(stdout, "\t -d [debug setting] [option]\n");
 	fprintf(stdout, "\t -l load default settings\n");
@@ -187,6 +466,7 @@ static void show_usage(void)
 	fprintf(stdout, "\t password type can be \"pap\" or \"pop\" \n");
 	fprintf(stdout, "\t encoding can be \"ascii\" or \"scancode\" \n");
 	fprintf(stdout, "\t kbdland can be \"us\" or \"fr\" or \"gr\"\n");
+	fprintf(stdout, "\t set THINKLMI_AUTH=\"password,encoding,kbdlang\" to authenticate other commands\n");
 	exit(1);
 }
 
@@ -196,8 +476,12 @@ int main(int argc, char *argv[])
     int fd;
     enum {
 	get_settings,
+	get_all,
+	watch,
 	get,
+	refresh,
 	set,
+	batch_set,
 	authenticate,
 	change_password,
 	debug,
@@ -219,6 +503,14 @@ int main(int argc, char *argv[])
 			    option = get_settings;
 		    else
 
+		    if (strcmp(argv[1], "getall") == 0)
+			    option = get_all;
+		    else
+
+		    if (strcmp(argv[1], "watch") == 0)
+			    option = watch;
+		    else
+
 	            if (strcmp(argv[1], "-l") == 0)
 		            option = load_default;
 		    else
@@ -229,6 +521,14 @@ int main(int argc, char *argv[])
 			    option = get;
 		    else
 
+		    if (strcmp(argv[1], "-r") == 0)
+			    option = refresh;
+		    else
+
+		    if (strcmp(argv[1], "-b") == 0)
+			    option = batch_set;
+		    else
+
 	            if (strcmp(argv[1], "save") == 0)
 			    option = save_settings;
 		    else
@@ -282,17 +582,33 @@ int main(int argc, char *argv[])
 	    perror("query_apps open");
 	    return 2;
     }
+    if (thinklmi_auth_from_env(fd)) {
+	    close(fd);
+	    return 3;
+    }
  
     switch (option) {
 	    case get_settings:
 		    get_settings_all(fd);
 		    break;
+	    case get_all:
+		    thinklmi_get_all(fd);
+		    break;
+	    case watch:
+		    thinklmi_watch(fd);
+		    break;
 	    case get:
-		    thinklmi_get(fd, argv[2]);
+		    thinklmi_get(fd, argv[2], 0);
+		    break;
+	    case refresh:
+		    thinklmi_get(fd, argv[2], 1);
 		    break;
 	    case set:
 		    thinklmi_set(fd, argv[2], argv[3]);
 		    break;
+	    case batch_set:
+		    thinklmi_batch_set(fd, argv[2]);
+		    break;
 	    case authenticate:
 		    thinklmi_authenticate(fd, argv[2], argv[3], argv[4]);
 		    break;